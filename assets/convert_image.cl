@@ -1,57 +1,78 @@
+/*
+ * These kernels are specialized at build time by pixconv.c.
+ * IN_R, IN_G and IN_B select the input channel (s0-s3) for each color,
+ * SCALE_X and SCALE_Y are the input/output size ratios,
+ * and SCALE_IDENTITY or SCALE_HALF select the fast paths for 1:1 and exact 2:1.
+ * With BATCH, the images are arrays with one frame per layer,
+ * and the third dimension of the global work size picks the layer.
+ */
+
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
 
+#if defined(BATCH)
+#define IMAGE image2d_array_t
+#define COORD(x, y) (int4)((x), (y), get_global_id(2), 0)
+#else
+#define IMAGE image2d_t
+#define COORD(x, y) (int2)((x), (y))
+#endif
+
+#if defined(SCALE_IDENTITY)
+// Coordinates map 1:1 and are always in bounds; no sampling necessary
+#define READ_INPUT(input, outx, outy) \
+	read_imageui(input, COORD(outx, outy))
+#elif defined(SCALE_HALF)
+#define READ_INPUT(input, outx, outy) \
+	read_imageui(input, COORD((outx) << 1, (outy) << 1))
+#else
+#define READ_INPUT(input, outx, outy) \
+	read_imageui(input, sampler, COORD( \
+		(int)((outx) * SCALE_X + (SCALE_X - 1) / 2), \
+		(int)((outy) * SCALE_Y + (SCALE_Y - 1) / 2)))
+#endif
+
 kernel void convert_rgb32_nv12(
-		float scale_x, float scale_y,
-		int in_r, int in_g, int in_b,
-		read_only image2d_t input,
-		write_only image2d_t output_y,
-		write_only image2d_t output_uv) {
+		read_only IMAGE input,
+		write_only IMAGE output_y,
+		write_only IMAGE output_uv) {
 
 	int outx = get_global_id(0);
 	int outy = get_global_id(1);
-	int inx = outx * scale_x + (scale_x - 1) / 2;
-	int iny = outy * scale_y + (scale_y - 1) / 2;
 
-	uint4 pixvec = read_imageui(input, sampler, (int2)(inx, iny));
-	uint *pix = &pixvec;
+	uint4 pix = READ_INPUT(input, outx, outy);
 
-	float pix_r = (float)pix[in_r];
-	float pix_g = (float)pix[in_g];
-	float pix_b = (float)pix[in_b];
+	float pix_r = (float)pix.IN_R;
+	float pix_g = (float)pix.IN_G;
+	float pix_b = (float)pix.IN_B;
 
 	uint pix_y = clamp( (0.257f * pix_r) + (0.504f * pix_g) + (0.098f * pix_b) + 16,  0.0f, 255.0f);
 	uint pix_u = clamp(-(0.148f * pix_r) - (0.291f * pix_g) + (0.439f * pix_b) + 128, 0.0f, 255.0f);
 	uint pix_v = clamp( (0.439f * pix_r) - (0.368f * pix_g) - (0.071f * pix_b) + 128, 0.0f, 255.0f);
 
-	write_imageui(output_y, (int2)(outx, outy), (uint4)(pix_y, 0, 0, 0));
-	write_imageui(output_uv, (int2)(outx / 2, outy / 2), (uint4)(pix_u, pix_v, 0, 255));
+	write_imageui(output_y, COORD(outx, outy), (uint4)(pix_y, 0, 0, 0));
+	write_imageui(output_uv, COORD(outx / 2, outy / 2), (uint4)(pix_u, pix_v, 0, 255));
 }
 
 kernel void convert_rgb32_yuv420(
-		float scale_x, float scale_y,
-		int in_r, int in_g, int in_b,
-		read_only image2d_t input,
-		write_only image2d_t output_y,
-		write_only image2d_t output_u,
-		write_only image2d_t output_v) {
+		read_only IMAGE input,
+		write_only IMAGE output_y,
+		write_only IMAGE output_u,
+		write_only IMAGE output_v) {
 
 	int outx = get_global_id(0);
 	int outy = get_global_id(1);
-	int inx = outx * scale_x + (scale_x - 1) / 2;
-	int iny = outy * scale_y + (scale_y - 1) / 2;
 
-	uint4 pixvec = read_imageui(input, sampler, (int2)(inx, iny));
-	uint *pix = &pixvec;
+	uint4 pix = READ_INPUT(input, outx, outy);
 
-	float pix_r = (float)pix[in_r];
-	float pix_g = (float)pix[in_g];
-	float pix_b = (float)pix[in_b];
+	float pix_r = (float)pix.IN_R;
+	float pix_g = (float)pix.IN_G;
+	float pix_b = (float)pix.IN_B;
 
 	uint pix_y = clamp( (0.257f * pix_r) + (0.504f * pix_g) + (0.098f * pix_b) + 16,  0.0f, 255.0f);
 	uint pix_u = clamp(-(0.148f * pix_r) - (0.291f * pix_g) + (0.439f * pix_b) + 128, 0.0f, 255.0f);
 	uint pix_v = clamp( (0.439f * pix_r) - (0.368f * pix_g) - (0.071f * pix_b) + 128, 0.0f, 255.0f);
 
-	write_imageui(output_y, (int2)(outx, outy), (uint4)(pix_y, 0, 0, 0));
-	write_imageui(output_u, (int2)(outx / 2, outy / 2), (uint4)(pix_u, 0, 0, 255));
-	write_imageui(output_v, (int2)(outx / 2, outy / 2), (uint4)(pix_v, 0, 0, 255));
+	write_imageui(output_y, COORD(outx, outy), (uint4)(pix_y, 0, 0, 0));
+	write_imageui(output_u, COORD(outx / 2, outy / 2), (uint4)(pix_u, 0, 0, 255));
+	write_imageui(output_v, COORD(outx / 2, outy / 2), (uint4)(pix_v, 0, 0, 255));
 }
@@ -0,0 +1,294 @@
+/*
+ * Microbenchmarks for the converter, the queues and cursor blending.
+ * Build with 'make xrecord-bench'.
+ *
+ * Results are written to stdout as JSON lines, one object per case,
+ * so that they can be collected and compared across releases.
+ * Usage: xrecord-bench [--time <seconds per case>] [pixconv|ringbuf|cursor...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "cursor.h"
+#include "latency.h"
+#include "pixconv.h"
+#include "ringbuf.h"
+#include "time.h"
+#include "util.h"
+
+#define WARMUP_ITERATIONS 3
+
+static double case_time = 1;
+
+static void print_histogram(struct histogram *h) {
+	printf("\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+			(unsigned long long)histogram_percentile(h, 50),
+			(unsigned long long)histogram_percentile(h, 90),
+			(unsigned long long)histogram_percentile(h, 99),
+			(unsigned long long)atomic_load(&h->max));
+}
+
+/*
+ * pixconv
+ */
+
+static const struct {
+	const char *name;
+	int w, h;
+} resolutions[] = {
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "4k", 3840, 2160 },
+	{ "8k", 7680, 4320 },
+};
+
+// Output size = input size * num / den
+static const struct {
+	int num, den;
+} scales[] = {
+	{ 1, 1 },
+	{ 1, 2 },
+	{ 2, 3 },
+};
+
+static const struct {
+	enum AVPixelFormat in, out;
+} formats[] = {
+	{ AV_PIX_FMT_BGRA, AV_PIX_FMT_NV12 },
+	{ AV_PIX_FMT_BGRA, AV_PIX_FMT_YUV420P },
+};
+
+static void bench_pixconv_case(
+		struct rect inrect, enum AVPixelFormat infmt,
+		struct rect outrect, enum AVPixelFormat outfmt) {
+	printf("{\"bench\":\"pixconv\",\"backend\":\"opencl\",\"in\":\"%s\",\"out\":\"%s\","
+			"\"in_w\":%i,\"in_h\":%i,\"out_w\":%i,\"out_h\":%i,",
+			av_get_pix_fmt_name(infmt), av_get_pix_fmt_name(outfmt),
+			inrect.w, inrect.h, outrect.w, outrect.h);
+
+	struct pixconv *conv = pixconv_create(inrect, infmt, outrect, outfmt);
+	if (conv == NULL) {
+		printf("\"error\":\"create failed\"}\n");
+		return;
+	}
+
+	uint8_t *inplanes[4];
+	int instrides[4];
+	uint8_t *outplanes[4];
+	int outstrides[4];
+	if (av_image_alloc(inplanes, instrides, inrect.w, inrect.h, infmt, 64) < 0 ||
+			av_image_alloc(outplanes, outstrides, outrect.w, outrect.h, outfmt, 64) < 0)
+		panic("Failed to allocate images.");
+
+	// Not all one color, so that nothing can take shortcuts
+	for (int y = 0; y < inrect.h; ++y) {
+		for (int x = 0; x < instrides[0]; ++x)
+			inplanes[0][y * instrides[0] + x] = x ^ y;
+	}
+
+	bool failed = false;
+	for (int i = 0; i < WARMUP_ITERATIONS && !failed; ++i)
+		failed = pixconv_convert(conv, inplanes, instrides, outplanes, outstrides) < 0;
+
+	struct histogram *h = calloc(1, sizeof(*h));
+	int iterations = 0;
+	double start = time_now();
+	double end = start;
+	while (!failed && end - start < case_time) {
+		uint64_t t = time_now_ns();
+		failed = pixconv_convert(conv, inplanes, instrides, outplanes, outstrides) < 0;
+		histogram_record(h, time_now_ns() - t);
+		iterations += 1;
+		end = time_now();
+	}
+
+	if (failed) {
+		printf("\"error\":\"convert failed\"}\n");
+	} else {
+		double mpix = (double)inrect.w * inrect.h * iterations / (end - start) / 1e6;
+		printf("\"iterations\":%i,\"mpix_per_s\":%.1f,\"fps\":%.1f,",
+				iterations, mpix, iterations / (end - start));
+		print_histogram(h);
+		printf("}\n");
+	}
+	fflush(stdout);
+
+	free(h);
+	av_freep(&inplanes[0]);
+	av_freep(&outplanes[0]);
+	pixconv_free(conv);
+}
+
+static void bench_pixconv() {
+	for (size_t r = 0; r < sizeof(resolutions) / sizeof(*resolutions); ++r) {
+		for (size_t s = 0; s < sizeof(scales) / sizeof(*scales); ++s) {
+			for (size_t f = 0; f < sizeof(formats) / sizeof(*formats); ++f) {
+				struct rect inrect = { 0, 0, resolutions[r].w, resolutions[r].h };
+				struct rect outrect = {
+					0, 0,
+					inrect.w * scales[s].num / scales[s].den & ~1,
+					inrect.h * scales[s].num / scales[s].den & ~1,
+				};
+				bench_pixconv_case(inrect, formats[f].in, outrect, formats[f].out);
+			}
+		}
+	}
+}
+
+/*
+ * ringbuf
+ */
+
+#define RINGBUF_ITEMS 200000
+
+struct ringbuf_bench {
+	struct ringbuf *rb;
+	struct histogram latency;
+};
+
+static void *ringbuf_consumer(void *arg) {
+	struct ringbuf_bench *b = (struct ringbuf_bench *)arg;
+	while (1) {
+		uint64_t *sent = ringbuf_read_start(b->rb);
+		if (sent == NULL)
+			break;
+
+		histogram_record(&b->latency, time_now_ns() - *sent);
+		ringbuf_read_end(b->rb);
+	}
+
+	return NULL;
+}
+
+static void bench_ringbuf_case(int nmemb) {
+	struct ringbuf_bench *b = calloc(1, sizeof(*b));
+	b->rb = ringbuf_create(sizeof(uint64_t), nmemb);
+
+	pthread_t th;
+	pthread_create(&th, NULL, ringbuf_consumer, b);
+
+	double start = time_now();
+	for (int i = 0; i < RINGBUF_ITEMS; ++i) {
+		uint64_t now = time_now_ns();
+		ringbuf_write(b->rb, &now);
+	}
+	ringbuf_close(b->rb);
+	pthread_join(th, NULL);
+	double t = time_now() - start;
+
+	printf("{\"bench\":\"ringbuf\",\"slots\":%i,\"items\":%i,\"items_per_s\":%.0f,",
+			nmemb, RINGBUF_ITEMS, RINGBUF_ITEMS / t);
+	print_histogram(&b->latency);
+	printf("}\n");
+	fflush(stdout);
+
+	ringbuf_destroy(b->rb);
+	free(b);
+}
+
+static void bench_ringbuf() {
+	// 4 is what the pipeline uses
+	bench_ringbuf_case(1);
+	bench_ringbuf_case(4);
+	bench_ringbuf_case(64);
+}
+
+/*
+ * Cursor blending
+ */
+
+static void bench_cursor_case(int size) {
+	struct rect frame = { 0, 0, 1920, 1080 };
+	int bpl = frame.w * 4;
+	uint8_t *pix = calloc(1, (size_t)bpl * frame.h);
+
+	// A mix of opaque, translucent and transparent pixels, like a real cursor
+	unsigned long *pixels = malloc(sizeof(*pixels) * size * size);
+	for (int i = 0; i < size * size; ++i) {
+		unsigned long a = (i % 3 == 0) ? 255 : (i % 3 == 1) ? 128 : 0;
+		pixels[i] = (a << 24) | ((a / 2) << 16) | ((a / 3) << 8) | (a / 4);
+	}
+
+	struct histogram *h = calloc(1, sizeof(*h));
+	int iterations = 0;
+	double start = time_now();
+	double end = start;
+	while (end - start < case_time) {
+		uint64_t t = time_now_ns();
+		cursor_blend(pix, bpl, frame, pixels, size, size,
+				(iterations * 7) % frame.w, (iterations * 5) % frame.h);
+		histogram_record(h, time_now_ns() - t);
+		iterations += 1;
+		end = time_now();
+	}
+
+	printf("{\"bench\":\"cursor\",\"size\":%i,\"iterations\":%i,", size, iterations);
+	print_histogram(h);
+	printf("}\n");
+	fflush(stdout);
+
+	free(h);
+	free(pixels);
+	free(pix);
+}
+
+static void bench_cursor() {
+	bench_cursor_case(24);
+	bench_cursor_case(64);
+	bench_cursor_case(256);
+}
+
+static const struct {
+	const char *name;
+	void (*func)();
+} benches[] = {
+	{ "pixconv", bench_pixconv },
+	{ "ringbuf", bench_ringbuf },
+	{ "cursor", bench_cursor },
+};
+
+int main(int argc, char **argv) {
+	struct option long_opts[] = {
+		{ "time", required_argument, 0, 't' },
+		{ "help", no_argument,       0, 'h' },
+		{ 0 },
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "t:h", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			case_time = atof(optarg);
+			break;
+
+		case 'h':
+			printf("Usage: %s [--time <seconds per case>] [pixconv|ringbuf|cursor...]\n", argv[0]);
+			return EXIT_SUCCESS;
+
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	size_t nbenches = sizeof(benches) / sizeof(*benches);
+	for (size_t i = 0; i < nbenches; ++i) {
+		bool selected = optind == argc;
+		for (int j = optind; j < argc; ++j) {
+			if (strcmp(argv[j], benches[i].name) == 0)
+				selected = true;
+		}
+
+		if (selected)
+			benches[i].func();
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include "cpuset.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "util.h"
+
+int cpuset_parse(cpu_set_t *set, const char *str) {
+	CPU_ZERO(set);
+
+	const char *s = str;
+	while (*s) {
+		char *end;
+		long first = strtol(s, &end, 10);
+		if (end == s || first < 0)
+			return -1;
+
+		long last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+
+		if (*end == ',')
+			end += 1;
+		else if (*end != '\0')
+			return -1;
+		s = end;
+	}
+
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Each cpuN directory in sysfs has a nodeM link to its node
+static int cpu_node(int cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+
+	int node = -1;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "node", 4) == 0 &&
+				ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+
+	closedir(dir);
+	return node;
+}
+
+int cpuset_node(const cpu_set_t *set) {
+	int node = -1;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+
+		int n = cpu_node(cpu);
+		if (n < 0 || (node >= 0 && n != node))
+			return -1;
+		node = n;
+	}
+
+	return node;
+}
+
+void cpuset_bind_memory(void *addr, size_t len, int node) {
+	static atomic_bool warned = false;
+	if (node < 0 || node >= 64)
+		return;
+
+	// mbind wants whole pages; leave the partial ones at the ends alone,
+	// they may belong to someone else's allocation
+	uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+	uintptr_t end = ((uintptr_t)addr + len) & ~(pagesize - 1);
+	if (end <= start)
+		return;
+
+	// Called through syscall() so that we don't need libnuma
+	unsigned long nodemask = 1ul << node;
+	long ret = syscall(SYS_mbind, (void *)start, end - start, MPOL_PREFERRED,
+			&nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE);
+	if (ret < 0 && !atomic_exchange(&warned, true))
+		logperror("mbind to node %i", node);
+}
@@ -0,0 +1,23 @@
+#ifndef CPUSET_H
+#define CPUSET_H
+
+#include <sched.h>
+#include <stddef.h>
+
+/*
+ * CPU sets and NUMA placement for the pipeline stages.
+ * Users of this header need _GNU_SOURCE for cpu_set_t.
+ */
+
+// Parse a CPU list like "0-3,8,10-11". Returns -1 if it's malformed.
+int cpuset_parse(cpu_set_t *set, const char *str);
+
+// The NUMA node all the CPUs in the set belong to,
+// or -1 if they span several nodes or the topology is unknown.
+int cpuset_node(const cpu_set_t *set);
+
+// Prefer placing the pages of [addr, addr+len) on 'node',
+// moving the ones already faulted in. Does nothing if 'node' is -1.
+void cpuset_bind_memory(void *addr, size_t len, int node);
+
+#endif
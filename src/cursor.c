@@ -0,0 +1,35 @@
+#include "cursor.h"
+
+// Inspired by paint_mouse_pointer from ffmpeg's x11grab.c
+// https://github.com/lu-zero/ffmpeg/blob/master/libavdevice/x11grab.c
+void cursor_blend(
+		uint8_t *pix, int bpl, struct rect size,
+		const unsigned long *pixels, int width, int height, int x, int y) {
+	for (int cy = 0; cy < height; ++cy) {
+		int iy = y + cy;
+		if (iy >= size.h || iy < 0) continue;
+
+		for (int cx = 0; cx < width; ++cx) {
+			int ix = x + cx;
+			if (ix >= size.w || ix < 0) continue;
+
+			int xcidx = cy * width + cx;
+			int imgidx = iy * bpl + ix * 4;
+
+			int r = (uint8_t)(pixels[xcidx] >> 0);
+			int g = (uint8_t)(pixels[xcidx] >> 8);
+			int b = (uint8_t)(pixels[xcidx] >> 16);
+			int a = (uint8_t)(pixels[xcidx] >> 24);
+
+			if (a == 255) {
+				pix[imgidx + 0] = r;
+				pix[imgidx + 1] = g;
+				pix[imgidx + 2] = b;
+			} else if (a) {
+				pix[imgidx + 0] = r + (pix[imgidx + 0] * (255 - a) + (255 / 2)) / 255;
+				pix[imgidx + 1] = g + (pix[imgidx + 1] * (255 - a) + (255 / 2)) / 255;
+				pix[imgidx + 2] = b + (pix[imgidx + 2] * (255 - a) + (255 / 2)) / 255;
+			}
+		}
+	}
+}
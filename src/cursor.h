@@ -0,0 +1,17 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include <stdint.h>
+
+#include "rect.h"
+
+/*
+ * Blend a cursor image onto a 32-bit BGRX frame.
+ * 'pixels' are premultiplied ARGB, one per unsigned long, like XFixesCursorImage.
+ * (x, y) is the cursor's top left corner relative to the frame.
+ */
+void cursor_blend(
+		uint8_t *pix, int bpl, struct rect size,
+		const unsigned long *pixels, int width, int height, int x, int y);
+
+#endif
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include "framepool.h"
+
+#include <stdlib.h>
+#include <libavutil/imgutils.h>
+
+#include "cpuset.h"
+#include "mem.h"
+#include "util.h"
+
+#define LINESIZE_ALIGN 64
+
+struct framepool_buf {
+	struct framepool *fp;
+	AVBufferRef *pooled;
+};
+
+static void release(void *opaque, uint8_t *data) {
+	struct framepool_buf *buf = opaque;
+	struct framepool *fp = buf->fp;
+
+	av_buffer_unref(&buf->pooled);
+	free(buf);
+
+	pthread_mutex_lock(&fp->mut);
+	fp->outstanding -= 1;
+	pthread_cond_broadcast(&fp->cond);
+	pthread_mutex_unlock(&fp->mut);
+}
+
+// The pool is only uninitialized once all buffers are back,
+// so 'fp' is still around when they're freed
+static void pool_free_buf(void *opaque, uint8_t *data) {
+	struct framepool *fp = opaque;
+	mem_free(data, fp->bufsize, fp->memflags);
+}
+
+static AVBufferRef *pool_alloc(void *opaque, size_t size) {
+	struct framepool *fp = opaque;
+	if (fp->memflags == 0) {
+		AVBufferRef *ref = av_buffer_alloc(size);
+		if (ref)
+			cpuset_bind_memory(ref->data, ref->size, fp->node);
+		return ref;
+	}
+
+	uint8_t *data = mem_alloc(size, fp->memflags);
+	cpuset_bind_memory(data, size, fp->node);
+	mem_prepare(data, size, fp->memflags);
+
+	AVBufferRef *ref = av_buffer_create(data, size, pool_free_buf, fp, 0);
+	if (ref == NULL)
+		mem_free(data, size, fp->memflags);
+	return ref;
+}
+
+struct framepool *framepool_create(
+		enum AVPixelFormat fmt, int width, int height, int cap,
+		int node, int memflags) {
+	struct framepool *fp = malloc(sizeof(*fp));
+	fp->fmt = fmt;
+	fp->width = width;
+	fp->height = height;
+	fp->outstanding = 0;
+	fp->cap = cap;
+	fp->node = node;
+	fp->memflags = memflags;
+	pthread_mutex_init(&fp->mut, NULL);
+	pthread_cond_init(&fp->cond, NULL);
+
+	if (av_image_fill_linesizes(fp->linesize, fmt, width) < 0)
+		panic("Failed to get linesizes for %s.", av_get_pix_fmt_name(fmt));
+	for (int i = 0; i < 4; ++i)
+		fp->linesize[i] = (fp->linesize[i] + LINESIZE_ALIGN - 1) & ~(LINESIZE_ALIGN - 1);
+
+	uint8_t *data[4];
+	int size = av_image_fill_pointers(data, fmt, height, NULL, fp->linesize);
+	if (size < 0)
+		panic("Failed to get frame size for %s.", av_get_pix_fmt_name(fmt));
+
+	fp->bufsize = size;
+	fp->pool = av_buffer_pool_init2(size, fp, pool_alloc, NULL);
+	if (fp->pool == NULL)
+		panic("Failed to create buffer pool.");
+
+	// Allocate the whole pool up front rather than while recording
+	if (memflags) {
+		AVBufferRef **bufs = malloc(sizeof(*bufs) * cap);
+		for (int i = 0; i < cap; ++i) {
+			bufs[i] = av_buffer_pool_get(fp->pool);
+			if (bufs[i] == NULL)
+				panic("Failed to get pooled buffer.");
+		}
+		for (int i = 0; i < cap; ++i)
+			av_buffer_unref(&bufs[i]);
+		free(bufs);
+	}
+
+	return fp;
+}
+
+AVFrame *framepool_get(struct framepool *fp) {
+	pthread_mutex_lock(&fp->mut);
+	while (fp->outstanding >= fp->cap)
+		pthread_cond_wait(&fp->cond, &fp->mut);
+	fp->outstanding += 1;
+	pthread_mutex_unlock(&fp->mut);
+
+	struct framepool_buf *buf = malloc(sizeof(*buf));
+	buf->fp = fp;
+	buf->pooled = av_buffer_pool_get(fp->pool);
+	if (buf->pooled == NULL)
+		panic("Failed to get pooled buffer.");
+
+	AVFrame *f = av_frame_alloc();
+	if (f == NULL)
+		panic("Failed to allocate AVFrame.");
+
+	f->format = fp->fmt;
+	f->width = fp->width;
+	f->height = fp->height;
+
+	// Wrap the pooled buffer so that we know when it's returned
+	f->buf[0] = av_buffer_create(
+			buf->pooled->data, buf->pooled->size, release, buf, 0);
+	if (f->buf[0] == NULL)
+		panic("Failed to create AVBufferRef.");
+
+	av_image_fill_pointers(f->data, fp->fmt, fp->height, f->buf[0]->data, fp->linesize);
+	memcpy(f->linesize, fp->linesize, sizeof(fp->linesize));
+
+	return f;
+}
+
+void framepool_free(struct framepool *fp) {
+	pthread_mutex_lock(&fp->mut);
+	while (fp->outstanding > 0)
+		pthread_cond_wait(&fp->cond, &fp->mut);
+	pthread_mutex_unlock(&fp->mut);
+
+	av_buffer_pool_uninit(&fp->pool);
+	pthread_mutex_destroy(&fp->mut);
+	pthread_cond_destroy(&fp->cond);
+	free(fp);
+}
@@ -0,0 +1,42 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * Pool of reference counted AVFrames.
+ * A frame's buffer goes back to the pool when its last reference is dropped,
+ * so the encoder can hold on to frames for as long as it wants.
+ */
+
+struct framepool {
+	AVBufferPool *pool;
+	enum AVPixelFormat fmt;
+	int width;
+	int height;
+	int linesize[4];
+
+	pthread_mutex_t mut;
+	pthread_cond_t cond;
+	int outstanding;
+	int cap;
+	int node;
+	int memflags;
+	size_t bufsize;
+};
+
+// The pool grows on demand, up to 'cap' frames.
+// The frames are placed on NUMA node 'node', or anywhere if it's -1.
+// With any MEM_* flags, all 'cap' frames are allocated and faulted in here.
+struct framepool *framepool_create(
+		enum AVPixelFormat fmt, int width, int height, int cap,
+		int node, int memflags);
+
+// Get a frame from the pool. Blocks if 'cap' frames are in use.
+AVFrame *framepool_get(struct framepool *fp);
+
+// Wait for all frames to be returned, then free the pool.
+void framepool_free(struct framepool *fp);
+
+#endif
@@ -0,0 +1,191 @@
+#include "gopenc.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+// Frames are sent to workers with their chunk index.
+// A NULL frame marks the end of a chunk.
+struct gopenc_frame {
+	AVFrame *frame;
+	int64_t chunk;
+};
+
+static void chunk_append(struct gopenc_chunk *chunk, AVPacket *pkt) {
+	if (chunk->npkts == chunk->cap) {
+		chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+		chunk->pkts = realloc(chunk->pkts, sizeof(*chunk->pkts) * chunk->cap);
+	}
+
+	chunk->pkts[chunk->npkts] = av_packet_alloc();
+	if (chunk->pkts[chunk->npkts] == NULL)
+		panic("Failed to allocate AVPacket.");
+	av_packet_move_ref(chunk->pkts[chunk->npkts], pkt);
+	chunk->npkts += 1;
+}
+
+static void receive_packets(AVCodecContext *avctx, AVPacket *pkt, struct gopenc_chunk *chunk) {
+	while (1) {
+		int ret = avcodec_receive_packet(avctx, pkt);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			break;
+		else if (ret < 0)
+			panic("Encoding error.");
+
+		chunk_append(chunk, pkt);
+	}
+}
+
+// Hand a finished chunk to the reorder stage,
+// and pass on every chunk which is now in order.
+static void submit(struct gopenc *g, struct gopenc_chunk *chunk) {
+	pthread_mutex_lock(&g->mut);
+
+	struct gopenc_chunk **pos = &g->done;
+	while (*pos && (*pos)->idx < chunk->idx)
+		pos = &(*pos)->next;
+	chunk->next = *pos;
+	*pos = chunk;
+
+	while (g->done && g->done->idx == g->next_chunk) {
+		struct gopenc_chunk *c = g->done;
+		g->done = c->next;
+
+		for (int i = 0; i < c->npkts; ++i) {
+			g->sink(g->opaque, c->pkts[i]);
+			av_packet_free(&c->pkts[i]);
+		}
+
+		free(c->pkts);
+		free(c);
+		g->next_chunk += 1;
+	}
+
+	pthread_mutex_unlock(&g->mut);
+}
+
+static void *worker_thread(void *arg) {
+	struct gopenc_worker *w = (struct gopenc_worker *)arg;
+	struct gopenc *g = w->g;
+
+	AVPacket *pkt = av_packet_alloc();
+	if (!pkt)
+		panic("Failed to allocate AVPacket.");
+
+	AVCodecContext *avctx = NULL;
+	struct gopenc_chunk *chunk = NULL;
+	while (1) {
+		struct gopenc_frame *gf = ringbuf_read_start(w->inq);
+		if (gf == NULL)
+			break;
+
+		AVFrame *frame = gf->frame;
+		int64_t idx = gf->chunk;
+		ringbuf_read_end(w->inq);
+
+		// End of chunk; drain the encoder and pass the chunk on
+		if (frame == NULL) {
+			if (avcodec_send_frame(avctx, NULL) < 0)
+				panic("Failed to flush codec.");
+			receive_packets(avctx, pkt, chunk);
+			avcodec_free_context(&avctx);
+
+			submit(g, chunk);
+			chunk = NULL;
+			continue;
+		}
+
+		// Start of chunk; every chunk gets a fresh encoder,
+		// so that it's a closed GOP which starts with a keyframe
+		if (avctx == NULL) {
+			const AVCodec *codec;
+			if (open_encoder(&codec, &avctx, g->encoder, &g->conf) < 0)
+				panic("Failed to open encoder for chunk %lli.", (long long)idx);
+
+			chunk = calloc(1, sizeof(*chunk));
+			chunk->idx = idx;
+		}
+
+		if (avcodec_send_frame(avctx, frame) < 0)
+			panic("Failed to send frame to codec.");
+		av_frame_free(&frame);
+
+		receive_packets(avctx, pkt, chunk);
+	}
+
+	av_packet_free(&pkt);
+	return NULL;
+}
+
+struct gopenc *gopenc_create(
+		int nworkers, int chunklen,
+		const char *encoder, struct encconf *conf,
+		gopenc_sink sink, void *opaque) {
+	struct gopenc *g = malloc(sizeof(*g));
+	g->encoder = encoder;
+	g->chunklen = chunklen;
+	g->frames = 0;
+	g->done = NULL;
+	g->next_chunk = 0;
+	g->sink = sink;
+	g->opaque = opaque;
+	pthread_mutex_init(&g->mut, NULL);
+
+	// B-frames would make the DTS of one chunk overlap with the previous one
+	g->conf = *conf;
+	g->conf.opts = NULL;
+	av_dict_copy(&g->conf.opts, conf->opts, 0);
+	av_dict_set_int(&g->conf.opts, "g", chunklen, 0);
+	av_dict_set(&g->conf.opts, "bf", "0", 0);
+	g->conf.quiet = true;
+
+	g->nworkers = nworkers;
+	g->workers = malloc(sizeof(*g->workers) * nworkers);
+	for (int i = 0; i < nworkers; ++i) {
+		struct gopenc_worker *w = &g->workers[i];
+		w->g = g;
+
+		// Room for a whole chunk and its end marker,
+		// so that the dispatcher can move on to the next worker
+		w->inq = ringbuf_create(sizeof(struct gopenc_frame), chunklen + 1);
+		pthread_create(&w->thread, NULL, worker_thread, w);
+	}
+
+	logln("Encoding chunks of %i frames on %i workers with %s.", chunklen, nworkers, encoder);
+	return g;
+}
+
+void gopenc_send(struct gopenc *g, AVFrame *frame) {
+	int64_t idx = g->frames / g->chunklen;
+	struct gopenc_worker *w = &g->workers[idx % g->nworkers];
+
+	struct gopenc_frame gf = { frame, idx };
+	ringbuf_write(w->inq, &gf);
+
+	g->frames += 1;
+	if (g->frames % g->chunklen == 0) {
+		struct gopenc_frame end = { NULL, idx };
+		ringbuf_write(w->inq, &end);
+	}
+}
+
+void gopenc_free(struct gopenc *g) {
+	// End the last, partial chunk
+	if (g->frames % g->chunklen != 0) {
+		int64_t idx = g->frames / g->chunklen;
+		struct gopenc_frame end = { NULL, idx };
+		ringbuf_write(g->workers[idx % g->nworkers].inq, &end);
+	}
+
+	for (int i = 0; i < g->nworkers; ++i) {
+		ringbuf_close(g->workers[i].inq);
+		pthread_join(g->workers[i].thread, NULL);
+		ringbuf_destroy(g->workers[i].inq);
+	}
+
+	assume(g->done == NULL);
+	av_dict_free(&g->conf.opts);
+	pthread_mutex_destroy(&g->mut);
+	free(g->workers);
+	free(g);
+}
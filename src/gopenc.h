@@ -0,0 +1,66 @@
+#ifndef GOPENC_H
+#define GOPENC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+#include "ringbuf.h"
+#include "venc.h"
+
+/*
+ * GOP-parallel encoder.
+ * Frames are dealt out in chunks to a number of workers, which each encode
+ * every chunk as a closed GOP with a fresh encoder instance.
+ * Finished chunks are put back in order before they're passed on.
+ */
+
+// Called with packets in order, and takes ownership of their references.
+typedef void (*gopenc_sink)(void *opaque, AVPacket *pkt);
+
+struct gopenc_chunk {
+	struct gopenc_chunk *next;
+	int64_t idx;
+	AVPacket **pkts;
+	int npkts;
+	int cap;
+};
+
+struct gopenc_worker {
+	struct gopenc *g;
+	struct ringbuf *inq;
+	pthread_t thread;
+};
+
+struct gopenc {
+	const char *encoder;
+	struct encconf conf;
+	int chunklen;
+
+	int nworkers;
+	struct gopenc_worker *workers;
+
+	// Dispatch state
+	int64_t frames;
+
+	// Reorder stage
+	pthread_mutex_t mut;
+	struct gopenc_chunk *done;
+	int64_t next_chunk;
+	gopenc_sink sink;
+	void *opaque;
+};
+
+// 'encoder' is the name of the encoder to open for every chunk.
+struct gopenc *gopenc_create(
+		int nworkers, int chunklen,
+		const char *encoder, struct encconf *conf,
+		gopenc_sink sink, void *opaque);
+
+// Queue a frame for encoding, taking ownership of it.
+void gopenc_send(struct gopenc *g, AVFrame *frame);
+
+// Encode all queued frames, pass on their packets and stop the workers.
+void gopenc_free(struct gopenc *g);
+
+#endif
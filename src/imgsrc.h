@@ -3,11 +3,19 @@
 
 #include "rect.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <libavcodec/avcodec.h>
 
 struct membuf {
 	void *data;
+
+	// Set by the capture thread
+	int64_t id;
+	uint64_t cap_start;
+	uint64_t cap_end;
+	bool keyframe; // The first frame after resuming
+	uint64_t paused_ns; // Time spent paused before this frame
 };
 
 struct imgsrc {
@@ -17,7 +25,8 @@ struct imgsrc {
 	// Free all memory allocated by imgsrc_create_*.
 	void (*free)(struct imgsrc *src);
 
-	// Set up a memory buffer (hopefully for shared memory)
+	// Set up a memory buffer (hopefully for shared memory).
+	// The caller is responsible for mem_prepare()ing it.
 	struct membuf *(*alloc_membuf)(struct imgsrc *src);
 
 	// Get a video frame.
@@ -28,6 +37,9 @@ struct imgsrc {
 	struct rect screensize;
 	enum AVPixelFormat pixfmt;
 
+	// MEM_* flags for the membufs, set by the caller before alloc_membuf
+	int memflags;
+
 	// Initialized in init
 	struct rect rect;
 	int bpl;
@@ -1,12 +1,15 @@
 #include "imgsrc.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/Xfixes.h>
 #include <sys/shm.h>
 
+#include "cursor.h"
+#include "mem.h"
 #include "rect.h"
 #include "util.h"
 #include "time.h"
@@ -21,6 +24,7 @@ struct imgsrc_x11 {
 	struct imgsrc imgsrc;
 	Display *display;
 	Window root;
+	bool warned_hugetlb;
 };
 
 static struct membuf *alloc_membuf_x11(struct imgsrc *src_) {
@@ -35,9 +39,17 @@ static struct membuf *alloc_membuf_x11(struct imgsrc *src_) {
 		panic("XShmCreateImage failed");
 
 	// Attach shm image
-	int ret = membuf->shminfo.shmid = shmget(IPC_PRIVATE,
-			membuf->image->bytes_per_line * membuf->image->height,
-			IPC_CREAT|0777);
+	size_t size = membuf->image->bytes_per_line * membuf->image->height;
+	int ret = -1;
+	if (src->imgsrc.memflags & MEM_HUGE_PAGES) {
+		ret = membuf->shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|SHM_HUGETLB|0777);
+		if (ret < 0 && !src->warned_hugetlb) {
+			logperror("Huge page shm failed (see vm.nr_hugepages)");
+			src->warned_hugetlb = true;
+		}
+	}
+	if (ret < 0)
+		ret = membuf->shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|0777);
 	if (ret < 0)
 		ppanic("shmget");
 
@@ -49,6 +61,12 @@ static struct membuf *alloc_membuf_x11(struct imgsrc *src_) {
 	if (!XShmAttach(src->display, &membuf->shminfo))
 		panic("XShmAttach failed");
 
+	// Once the X server has attached too, the segment can be marked for removal,
+	// so that it goes away with us even if we crash
+	XSync(src->display, False);
+	if (shmctl(membuf->shminfo.shmid, IPC_RMID, NULL) < 0)
+		logperror("shmctl IPC_RMID");
+
 	src->imgsrc.bpl = membuf->image->bytes_per_line;
 	membuf->membuf.data = membuf->image->data;
 
@@ -74,39 +92,12 @@ static void get_frame_x11(struct imgsrc *src_, struct membuf *membuf_) {
 			src->imgsrc.rect.x, src->imgsrc.rect.y, AllPlanes))
 		panic("XShmGetImage failed");
 
-	uint8_t *pix = (uint8_t *)membuf->image->data;
-
 	XFixesCursorImage *xcim = XFixesGetCursorImage(src->display);
-
-	// Inspired by paint_mouse_pointer from ffmpeg's x11grab.c
-	// https://github.com/lu-zero/ffmpeg/blob/master/libavdevice/x11grab.c
-	for (int x = 0; x < xcim->width; ++x) {
-		for (int y = 0; y < xcim->height; ++y) {
-			int ix = xcim->x - xcim->xhot + x;
-			int iy = xcim->y - xcim->yhot + y;
-			if (ix > src->imgsrc.rect.w || ix < 0) continue;
-			if (iy > src->imgsrc.rect.h || iy < 0) continue;
-
-			int xcidx = y * xcim->width + x;
-			int imgidx = iy * src->imgsrc.bpl + ix * 4;
-
-			int r = (uint8_t)(xcim->pixels[xcidx] >> 0);
-			int g = (uint8_t)(xcim->pixels[xcidx] >> 8);
-			int b = (uint8_t)(xcim->pixels[xcidx] >> 16);
-			int a = (uint8_t)(xcim->pixels[xcidx] >> 24);
-
-			if (a == 255) {
-				pix[imgidx + 0] = r;
-				pix[imgidx + 1] = g;
-				pix[imgidx + 2] = b;
-			} else if (a) {
-				pix[imgidx + 0] = r + (pix[imgidx + 0] * (255 - a) + (255 / 2)) / 255;
-				pix[imgidx + 1] = g + (pix[imgidx + 1] * (255 - a) + (255 / 2)) / 255;
-				pix[imgidx + 2] = b + (pix[imgidx + 2] * (255 - a) + (255 / 2)) / 255;
-			}
-		}
-	}
-
+	cursor_blend(
+			(uint8_t *)membuf->image->data, src->imgsrc.bpl, src->imgsrc.rect,
+			xcim->pixels, xcim->width, xcim->height,
+			xcim->x - xcim->xhot - src->imgsrc.rect.x,
+			xcim->y - xcim->yhot - src->imgsrc.rect.y);
 	XFree(xcim);
 }
 
@@ -116,6 +107,8 @@ struct imgsrc *imgsrc_create_x11() {
 	src->imgsrc.free = free_x11;
 	src->imgsrc.alloc_membuf = alloc_membuf_x11;
 	src->imgsrc.get_frame = get_frame_x11;
+	src->imgsrc.memflags = 0;
+	src->warned_hugetlb = false;
 
 	src->display = XOpenDisplay(NULL);
 	assume(src->display != NULL);
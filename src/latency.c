@@ -0,0 +1,131 @@
+#include "latency.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+AVBufferRef *frameinfo_alloc() {
+	AVBufferRef *ref = av_buffer_allocz(sizeof(struct frameinfo));
+	if (ref == NULL)
+		panic("Failed to allocate frame info.");
+	return ref;
+}
+
+struct frameinfo *frameinfo_get(AVBufferRef *ref) {
+	if (ref == NULL || ref->size < sizeof(struct frameinfo))
+		return NULL;
+	return (struct frameinfo *)ref->data;
+}
+
+/*
+ * Histogram
+ */
+
+static int bucket_index(uint64_t value) {
+	if (value < (1 << HISTOGRAM_SUB_BITS))
+		return value;
+
+	int exp = 63 - __builtin_clzll(value);
+	int shift = exp - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+		(int)((value >> shift) - (1 << HISTOGRAM_SUB_BITS));
+}
+
+// The highest value which falls in a bucket
+static uint64_t bucket_value(int idx) {
+	if (idx < (1 << HISTOGRAM_SUB_BITS))
+		return idx;
+
+	int shift = (idx >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t sub = (idx & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS);
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t value) {
+	atomic_fetch_add_explicit(&h->counts[bucket_index(value)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+	uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (value > max && !atomic_compare_exchange_weak_explicit(
+				&h->max, &max, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t histogram_percentile(struct histogram *h, double p) {
+	uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	if (count == 0)
+		return 0;
+
+	uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	uint64_t target = (uint64_t)(count * p / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+		if (seen >= target) {
+			uint64_t val = bucket_value(i);
+			return val < max ? val : max;
+		}
+	}
+
+	return max;
+}
+
+/*
+ * Latency
+ */
+
+static const char *stage_names[LATENCY_STAGES] = {
+	[LATENCY_CAPTURE] = "capture",
+	[LATENCY_QUEUE] = "queue",
+	[LATENCY_CONVERT] = "convert",
+	[LATENCY_ENCODE] = "encode",
+	[LATENCY_WRITE] = "write",
+	[LATENCY_TOTAL] = "total",
+};
+
+const char *latency_stage_name(enum latency_stage stage) {
+	return stage_names[stage];
+}
+
+struct latency *latency_create() {
+	struct latency *l = calloc(1, sizeof(*l));
+	assume(l != NULL);
+	return l;
+}
+
+// Clamped, so that a missing timestamp doesn't show up as a huge latency
+static uint64_t span(uint64_t start, uint64_t end) {
+	return end > start ? end - start : 0;
+}
+
+void latency_record(struct latency *l, const struct frameinfo *fi, uint64_t now) {
+	histogram_record(&l->stages[LATENCY_CAPTURE], span(fi->cap_start, fi->cap_end));
+	histogram_record(&l->stages[LATENCY_QUEUE],
+			span(fi->cap_end, fi->conv_start) + span(fi->conv_end, fi->enc_start));
+	histogram_record(&l->stages[LATENCY_CONVERT], span(fi->conv_start, fi->conv_end));
+	histogram_record(&l->stages[LATENCY_ENCODE], span(fi->enc_start, fi->enc_end));
+	histogram_record(&l->stages[LATENCY_WRITE], span(fi->enc_end, now));
+	histogram_record(&l->stages[LATENCY_TOTAL], span(fi->cap_start, now));
+}
+
+void latency_report(struct latency *l, const char *name) {
+	if (atomic_load(&l->stages[LATENCY_TOTAL].count) == 0)
+		return;
+
+	logln("%s: latency in ms (p50 / p90 / p99 / max) over %llu frames:", name,
+			(unsigned long long)atomic_load(&l->stages[LATENCY_TOTAL].count));
+	for (int i = 0; i < LATENCY_STAGES; ++i) {
+		struct histogram *h = &l->stages[i];
+		logln("  %-8s %8.3f %8.3f %8.3f %8.3f", latency_stage_name(i),
+				histogram_percentile(h, 50) / 1000000.0,
+				histogram_percentile(h, 90) / 1000000.0,
+				histogram_percentile(h, 99) / 1000000.0,
+				atomic_load(&h->max) / 1000000.0);
+	}
+}
+
+void latency_free(struct latency *l) {
+	free(l);
+}
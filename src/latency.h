@@ -0,0 +1,82 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * Per-frame timestamps, carried from the capture thread to the written packet
+ * in the frame's and packet's opaque_ref. All times are time_now_ns().
+ */
+struct frameinfo {
+	int64_t id;
+	uint64_t cap_start;
+	uint64_t cap_end;
+	uint64_t conv_start;
+	uint64_t conv_end;
+	uint64_t enc_start;
+	uint64_t enc_end;
+
+	// Encode as a keyframe, e.g because it's the first after resuming
+	bool keyframe;
+
+	// Time spent paused before the frame was captured, which the
+	// output's timestamps leave out
+	uint64_t paused_ns;
+};
+
+// Allocate a buffer for a frameinfo, to be used as an opaque_ref.
+AVBufferRef *frameinfo_alloc();
+
+// The frameinfo in an opaque_ref, or NULL if there's none.
+struct frameinfo *frameinfo_get(AVBufferRef *ref);
+
+/*
+ * Log-linear histogram of nanosecond values, in the style of HdrHistogram:
+ * every power of two is split into 32 buckets, so percentiles are
+ * accurate to about 3%. Recording is lock-free and can happen from any thread.
+ */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+	_Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t max;
+};
+
+void histogram_record(struct histogram *h, uint64_t value);
+
+// The value at percentile 'p' (0-100), or 0 if nothing is recorded.
+uint64_t histogram_percentile(struct histogram *h, double p);
+
+enum latency_stage {
+	LATENCY_CAPTURE,
+	LATENCY_QUEUE, // Waiting for the converter and the encoder
+	LATENCY_CONVERT,
+	LATENCY_ENCODE,
+	LATENCY_WRITE, // Waiting for and writing to the file
+	LATENCY_TOTAL, // From the start of capture to the packet being written
+	LATENCY_STAGES,
+};
+
+const char *latency_stage_name(enum latency_stage stage);
+
+struct latency {
+	struct histogram stages[LATENCY_STAGES];
+};
+
+struct latency *latency_create();
+
+// Record the latencies of a frame whose packet is done at 'now'.
+void latency_record(struct latency *l, const struct frameinfo *fi, uint64_t now);
+
+// Log p50/p90/p99/max for every stage, since the start.
+void latency_report(struct latency *l, const char *name);
+
+void latency_free(struct latency *l);
+
+#endif
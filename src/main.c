@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -5,6 +6,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
 #include <libavcodec/avcodec.h>
 
 #include "ringbuf.h"
@@ -15,41 +17,164 @@
 #include "imgsrc.h"
 #include "pixconv.h"
 #include "venc.h"
+#include "mux.h"
+#include "writer.h"
+#include "framepool.h"
+#include "replay.h"
+#include "gopenc.h"
+#include "transcode.h"
+#include "latency.h"
+#include "stats.h"
+#include "stage.h"
+#include "reorder.h"
+#include "cpuset.h"
+#include "mem.h"
+#include "stream.h"
+#include "shmring.h"
+#include "rawsink.h"
+#include "pause.h"
 
 #define NUM_BUFFERS 4
+#define MAX_OUTPUTS 8
+#define LATENCY_REPORT_INTERVAL 10 // Seconds
+#define DEFAULT_SYNC_INTERVAL 2 // Seconds
+#define MAX_CONV_BATCH 16
+#define SHM_SLOTS 8
+#define RECV_TIMEOUT_MS 100
+
+// Options given before an output file apply to that output,
+// and carry over to the outputs after it.
+struct outconf {
+	struct rect rect;
+	bool size_set;
+	const char *file;
+	const char *format;
+	bool faststart;
+	bool direct;
+	bool preallocate;
+	double sync_interval; // Negative to sync only when preallocating
+	const char *encoder;
+	const char *profile;
+	const char *pix_fmt;
+	AVDictionary *encopts;
+	int gop_workers;
+	int gop_chunk;
+};
+
+// Pipeline stages, in order. Stages after config.stop_after are replaced
+// with sinks which discard their input, to benchmark the stages before them.
+enum stage_id {
+	STAGE_CAP,
+	STAGE_CONV,
+	STAGE_ENC,
+	STAGE_WRITE,
+};
+
+static const char *stage_names[] = { "cap", "conv", "enc" };
 
 struct config {
 	struct rect inrect;
-	struct rect outrect;
-	const char *outfile;
+	struct outconf outputs[MAX_OUTPUTS];
+	int noutputs;
+	size_t write_budget;
+	size_t stream_backlog;
+	double replay_seconds;
+	size_t replay_budget;
+	int frame_pool;
 	const char *timelinefile;
+	const char *transcode;
+	const char *attach;
+	const char *stats_socket;
+	enum stage_id stop_after;
+	int conv_workers;
+	int conv_batch;
+	double duration;
 	double fps;
+
+	// Indexed by stage_id, for cap, conv and enc. The writers share
+	// their encoder's CPUs.
+	cpu_set_t cpus[STAGE_WRITE];
+	bool cpus_set[STAGE_WRITE];
+	int cap_policy;
+	int cap_priority;
+	int memflags;
+	bool start_paused;
 };
 
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_stop(int sig) {
+	stopping = 1;
+	pause_wake();
+
+	// A second signal kills us if shutting down gets stuck
+	signal(sig, SIG_DFL);
+}
+
+static void handle_dump(int sig) {
+	replay_request_dump();
+}
+
+static void handle_pause(int sig) {
+	pause_toggle();
+}
+
 /*
  * Capturer
  */
 
+// Membufs go round from freeq, through the capturer to outq,
+// through a converter and back to freeq
 struct capctx {
 	struct imgsrc *imgsrc;
+	struct ringbuf *freeq;
 	struct ringbuf *outq;
+	struct stats *stats;
 	double fps;
+	double duration;
 };
 
-static void *cap_thread(void *arg) {
-	struct capctx *ctx = (struct capctx *)arg;
+static void cap_worker(struct stage *st, int idx) {
+	struct capctx *ctx = (struct capctx *)st->ctx;
 
 	double acc = 0;
 	double prev = time_now();
 	double target = (double)1 / ctx->fps;
+	double deadline = prev + ctx->duration;
+
+	int64_t id = 0;
+	bool resumed = false;
+	uint64_t paused_ns = 0;
+	while (!stopping && (ctx->duration <= 0 || time_now() < deadline)) {
+		// Time spent paused neither counts towards the duration,
+		// nor is it time we fell behind by
+		double paused = pause_wait(&stopping);
+		if (paused > 0) {
+			deadline += paused;
+			prev = time_now();
+			acc = 0;
+			resumed = true;
+			paused_ns += paused * 1e9;
+		}
+		if (stopping)
+			break;
 
-	while (1) {
-		struct membuf **membuf = ringbuf_write_start(ctx->outq);
+		struct membuf *membuf;
+		if (!ringbuf_pop(ctx->freeq, &membuf))
+			break;
 
+		timeline_frame(id);
 		timeline_begin("cap");
-		ctx->imgsrc->get_frame(ctx->imgsrc, *membuf);
-		ringbuf_write_end(ctx->outq);
+		membuf->id = id++;
+		membuf->keyframe = resumed;
+		membuf->paused_ns = paused_ns;
+		resumed = false;
+		membuf->cap_start = time_now_ns();
+		ctx->imgsrc->get_frame(ctx->imgsrc, membuf);
+		membuf->cap_end = time_now_ns();
+		ringbuf_push(ctx->outq, &membuf);
 		timeline_end("cap");
+		stats_add(&ctx->stats->captured, 1);
 
 		double now = time_now();
 		if (ctx->fps != INFINITY) {
@@ -59,46 +184,205 @@ static void *cap_thread(void *arg) {
 				acc -= time_now() - now;
 			} else if (acc < -2) {
 				logln("Can't keep up! Skipping %.3fms.", -(acc * 1000.0));
+				stats_add(&ctx->stats->skipped, -acc * ctx->fps);
 				acc = 0;
 			}
 		}
 		prev = time_now();
 	}
+}
 
-	return NULL;
+static void cap_done(struct stage *st) {
+	struct capctx *ctx = (struct capctx *)st->ctx;
+	ringbuf_close(ctx->outq);
 }
 
 /*
  * Converter
  */
 
+// Each captured frame is converted once for every output.
+// Every worker has its own pixconvs, and so its own command queue;
+// frames are put back in capture order before they go to the encoders.
 struct convctx {
-	struct pixconv *conv;
+	int n;
+	int batch;
+	struct pixconv *convs[STAGE_MAX_WORKERS][MAX_OUTPUTS];
+	struct framepool *pools[MAX_OUTPUTS];
+	struct ringbuf *outqs[MAX_OUTPUTS];
+	struct reorder *reorder;
 	int bpl;
 	struct ringbuf *inq;
-	struct ringbuf *outq;
+	struct ringbuf *freeq;
+	struct stats *stats;
+	bool discard;
 };
 
-static void *conv_thread(void *arg) {
-	struct convctx *ctx = (struct convctx *)arg;
+// Called by the reorder buffer in capture order
+static void emit_frames(void *opaque, void *item) {
+	struct convctx *ctx = (struct convctx *)opaque;
+	AVFrame **frames = (AVFrame **)item;
+	for (int i = 0; i < ctx->n; ++i)
+		ringbuf_write(ctx->outqs[i], &frames[i]);
+}
 
-	while (1) {
-		struct membuf **membuf = ringbuf_read_start(ctx->inq);
-		AVFrame **frame = ringbuf_write_start(ctx->outq);
+static void conv_worker(struct stage *st, int idx) {
+	struct convctx *ctx = (struct convctx *)st->ctx;
+
+	// Up to ctx->batch captured frames, and their converted frames for each output
+	struct membuf *membufs[MAX_CONV_BATCH];
+	uint8_t *inplanes[MAX_CONV_BATCH][1];
+	struct pixconv_image in[MAX_CONV_BATCH];
+	AVFrame *frames[MAX_CONV_BATCH][MAX_OUTPUTS];
+	struct pixconv_image out[MAX_CONV_BATCH * MAX_OUTPUTS];
+	while (ringbuf_pop(ctx->inq, &membufs[0])) {
+		if (ctx->discard) {
+			ringbuf_push(ctx->freeq, &membufs[0]);
+			continue;
+		}
 
+		// Batch up whatever else is already waiting. When we keep up, that's nothing,
+		// so frames are only ever held back when there's a backlog anyway.
+		int k = 1;
+		while (k < ctx->batch && ringbuf_trypop(ctx->inq, &membufs[k]))
+			k += 1;
+
+		// Blocks if an encoder is holding on to too many frames
+		for (int j = 0; j < k; ++j) {
+			inplanes[j][0] = membufs[j]->data;
+			in[j].planes = inplanes[j];
+			in[j].strides = &ctx->bpl;
+			for (int i = 0; i < ctx->n; ++i) {
+				frames[j][i] = framepool_get(ctx->pools[i]);
+				out[j * ctx->n + i].planes = frames[j][i]->data;
+				out[j * ctx->n + i].strides = frames[j][i]->linesize;
+			}
+		}
+
+		timeline_frame(membufs[0]->id);
 		timeline_begin("conv");
-		int ret = pixconv_convert(ctx->conv,
-				(uint8_t  *[]) { (*membuf)->data }, (const int[]) { ctx->bpl },
-				(*frame)->data, (*frame)->linesize);
+		uint64_t conv_start = time_now_ns();
+		int ret = pixconv_convert_batch(ctx->convs[idx], ctx->n, k, in, out);
 		if (ret < 0)
 			panic("Pixel conversion failed.");
+		uint64_t conv_end = time_now_ns();
+
+		// Every output gets its own frame info, since they're encoded separately
+		int64_t ids[MAX_CONV_BATCH];
+		for (int j = 0; j < k; ++j) {
+			struct membuf *membuf = membufs[j];
+			for (int i = 0; i < ctx->n; ++i) {
+				frames[j][i]->opaque_ref = frameinfo_alloc();
+				struct frameinfo *fi = frameinfo_get(frames[j][i]->opaque_ref);
+				fi->id = membuf->id;
+				fi->cap_start = membuf->cap_start;
+				fi->cap_end = membuf->cap_end;
+				fi->conv_start = conv_start;
+				fi->conv_end = conv_end;
+				fi->keyframe = membuf->keyframe;
+				fi->paused_ns = membuf->paused_ns;
+			}
 
-		ringbuf_write_end(ctx->outq);
-		ringbuf_read_end(ctx->inq);
+			ids[j] = membuf->id;
+			ringbuf_push(ctx->freeq, &membuf);
+		}
 		timeline_end("conv");
+		stats_add(&ctx->stats->converted, k);
+
+		for (int j = 0; j < k; ++j)
+			reorder_put(ctx->reorder, ids[j], frames[j]);
 	}
+}
 
-	return NULL;
+static void conv_done(struct stage *st) {
+	struct convctx *ctx = (struct convctx *)st->ctx;
+	for (int i = 0; i < ctx->n; ++i)
+		ringbuf_close(ctx->outqs[i]);
+}
+
+/*
+ * Receiver
+ */
+
+// With --attach, frames come converted from another xrecord's shared memory
+// ring and replace both the capturer and the converter. The convctx only
+// provides the outputs' frame pools and queues.
+struct recvctx {
+	struct shmring *ring;
+	struct convctx *conv;
+	struct stats *stats;
+	double duration;
+};
+
+static void recv_worker(struct stage *st, int idx) {
+	struct recvctx *ctx = (struct recvctx *)st->ctx;
+	struct convctx *conv = ctx->conv;
+	double deadline = time_now() + ctx->duration;
+
+	AVFrame *frames[MAX_OUTPUTS];
+	uint64_t skipped = 0;
+	bool resumed = false;
+	uint64_t paused_ns = 0;
+	while (!stopping && (ctx->duration <= 0 || time_now() < deadline)) {
+		// While paused, we miss the server's frames like any slow consumer
+		double paused = pause_wait(&stopping);
+		if (paused > 0) {
+			deadline += paused;
+			resumed = true;
+			paused_ns += paused * 1e9;
+		}
+		if (stopping)
+			break;
+
+		// Blocks if an encoder is holding on to too many frames
+		for (int i = 0; i < conv->n; ++i) {
+			frames[i] = framepool_get(conv->pools[i]);
+			frames[i]->opaque_ref = frameinfo_alloc();
+		}
+
+		struct frameinfo *fi = frameinfo_get(frames[0]->opaque_ref);
+		int ret;
+		do {
+			ret = shmring_read(ctx->ring, frames[0], fi, RECV_TIMEOUT_MS);
+		} while (ret == 0 && !stopping);
+
+		if (ret <= 0) {
+			for (int i = 0; i < conv->n; ++i)
+				av_frame_free(&frames[i]);
+			if (ret < 0)
+				logln("The capture server went away.");
+			break;
+		}
+
+		// On top of the server's pauses, leave out our own
+		fi->keyframe = resumed;
+		fi->paused_ns += paused_ns;
+		resumed = false;
+
+		timeline_frame(fi->id);
+		timeline_begin("cap");
+		for (int i = 1; i < conv->n; ++i) {
+			if (av_frame_copy(frames[i], frames[0]) < 0)
+				panic("Failed to copy frame.");
+			*frameinfo_get(frames[i]->opaque_ref) = *fi;
+		}
+		timeline_end("cap");
+
+		stats_add(&ctx->stats->captured, 1);
+		stats_add(&ctx->stats->converted, 1);
+		if (ctx->ring->skipped > skipped) {
+			stats_add(&ctx->stats->skipped, ctx->ring->skipped - skipped);
+			skipped = ctx->ring->skipped;
+		}
+
+		emit_frames(conv, frames);
+	}
+}
+
+static void recv_done(struct stage *st) {
+	struct recvctx *ctx = (struct recvctx *)st->ctx;
+	for (int i = 0; i < ctx->conv->n; ++i)
+		ringbuf_close(ctx->conv->outqs[i]);
 }
 
 /*
@@ -106,78 +390,247 @@ static void *conv_thread(void *arg) {
  */
 
 struct encctx {
+	const char *name;
+	char tlname[16];
 	const AVCodec *codec;
 	AVCodecContext *avctx;
 	enum AVPixelFormat fmt;
-	FILE *file;
+	// Packets go to either the writer, the stream or the replay buffer
+	struct writer *writer;
+	struct stream *stream;
+	struct replay *replay;
+
+	// Non-NULL when encoding GOP chunks in parallel
+	struct gopenc *gopenc;
+
+	// Non-NULL when frames are served to other processes or written raw
+	// instead of encoded
+	struct shmring *shm;
+	struct rawsink *raw;
+
+	struct latency *latency;
+	struct stats_output *stats;
+
+	// Drop frames instead of encoding them
+	bool discard;
+
 	struct ringbuf *inq;
 };
 
-static void *enc_thread(void *arg) {
-	struct encctx *ctx = (struct encctx *)arg;
+static void sink_packet(void *opaque, AVPacket *pkt) {
+	struct encctx *ctx = (struct encctx *)opaque;
+	struct frameinfo *fi = frameinfo_get(pkt->opaque_ref);
+	if (fi)
+		fi->enc_end = time_now_ns();
+
+	stats_add(&ctx->stats->packets, 1);
+	stats_add(&ctx->stats->bytes, pkt->size);
+
+	if (ctx->replay) {
+		// Packets stay in memory; they're done once they're in the buffer
+		if (fi)
+			latency_record(ctx->latency, fi, fi->enc_end);
+		replay_push(ctx->replay, pkt);
+	} else if (ctx->writer) {
+		writer_push(ctx->writer, pkt);
+	} else if (ctx->stream) {
+		stream_push(ctx->stream, pkt);
+	} else {
+		// Not writing; the packet is done once it's encoded
+		if (fi)
+			latency_record(ctx->latency, fi, fi->enc_end);
+		av_packet_unref(pkt);
+	}
+}
 
-	// Create hardware frame if we have a hardare encoder
-	AVFrame *hwframe = NULL;
-	if (ctx->avctx->hw_frames_ctx) {
-		hwframe = av_frame_alloc();
-		if (hwframe == NULL)
-			panic("Failed to allocate hardware frame.");
+// Receive all available packets from the encoder and queue them for writing
+static void write_packets(struct encctx *ctx, AVPacket *pkt) {
+	while (1) {
+		int ret = avcodec_receive_packet(ctx->avctx, pkt);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			break;
+		else if (ret < 0)
+			panic("Encoding error.");
 
-		if (av_hwframe_get_buffer(ctx->avctx->hw_frames_ctx, hwframe, 0) < 0)
-			panic("Failed to get hardware buffer.");
+		sink_packet(ctx, pkt);
 	}
+}
+
+static void enc_worker(struct stage *st, int idx) {
+	struct encctx *ctx = (struct encctx *)st->ctx;
 
 	AVPacket *pkt = av_packet_alloc();
 	if (!pkt)
 		panic("Failed to allocate AVPacket.");
 
-	int pts = 0;
+	// Timestamps follow the capture clock, less the time spent paused,
+	// so that skipped frames and --fps max play back at the speed they
+	// were captured. They only have to increase.
+	int64_t next_pts = 0;
+	int64_t start_ns = -1;
 
 	double nextsec = time_now() + 1;
 	int framecount = 0;
+	int seconds = 0;
 	while (1) {
 		if (time_now() >= nextsec) {
-			logln("FPS: %i", framecount);
+			logln("%s: FPS: %i", ctx->name, framecount);
 			framecount = 0;
 			nextsec += 1;
+			if (++seconds % LATENCY_REPORT_INTERVAL == 0)
+				latency_report(ctx->latency, ctx->name);
 		}
 		framecount += 1;
 
 		AVFrame **avf = ringbuf_read_start(ctx->inq);
+		if (avf == NULL)
+			break;
 
-		timeline_begin("enc");
-		(*avf)->pts = pts++;
+		AVFrame *f = *avf;
+		ringbuf_read_end(ctx->inq);
 
-		AVFrame *f;
-		if (hwframe) {
-			f = hwframe;
-			if (av_hwframe_transfer_data(hwframe, *avf, 0) < 0)
+		struct frameinfo *fi = frameinfo_get(f->opaque_ref);
+		if (fi) {
+			fi->enc_start = time_now_ns();
+			timeline_frame(fi->id);
+		}
+
+		timeline_begin(ctx->tlname);
+
+		f->pts = next_pts;
+		if (fi && ctx->avctx) {
+			int64_t t = fi->cap_start - fi->paused_ns;
+			if (start_ns < 0)
+				start_ns = t;
+			int64_t cap_pts = av_rescale_q(
+					t - start_ns, (AVRational) { 1, 1000000000 }, ctx->avctx->time_base);
+			if (cap_pts > f->pts)
+				f->pts = cap_pts;
+		}
+		next_pts = f->pts + 1;
+		if (fi && fi->keyframe)
+			f->pict_type = AV_PICTURE_TYPE_I;
+		stats_add(&ctx->stats->frames, 1);
+
+		if (ctx->discard) {
+			av_frame_free(&f);
+			timeline_end(ctx->tlname);
+			continue;
+		}
+
+		if (ctx->gopenc) {
+			gopenc_send(ctx->gopenc, f);
+			timeline_end(ctx->tlname);
+			continue;
+		}
+
+		if (ctx->shm || ctx->raw) {
+			if (ctx->shm) {
+				shmring_publish(ctx->shm, f, fi);
+			} else {
+				ssize_t n = rawsink_write(ctx->raw, f);
+				if (n >= 0)
+					stats_add(&ctx->stats->bytes, n);
+			}
+
+			if (fi)
+				latency_record(ctx->latency, fi, time_now_ns());
+			av_frame_free(&f);
+			timeline_end(ctx->tlname);
+			continue;
+		}
+
+		// Served and raw outputs have no encoder; they should have been discarding
+		if (ctx->avctx == NULL) {
+			av_frame_free(&f);
+			timeline_end(ctx->tlname);
+			continue;
+		}
+
+		// Upload to a hardware frame if we have a hardware encoder
+		if (ctx->avctx->hw_frames_ctx) {
+			AVFrame *hwframe = av_frame_alloc();
+			if (hwframe == NULL)
+				panic("Failed to allocate hardware frame.");
+			if (av_hwframe_get_buffer(ctx->avctx->hw_frames_ctx, hwframe, 0) < 0)
+				panic("Failed to get hardware buffer.");
+			if (av_hwframe_transfer_data(hwframe, f, 0) < 0)
 				panic("Failed to transfer data to hardware frame.");
-		} else {
-			f = *avf;
+			if (av_frame_copy_props(hwframe, f) < 0)
+				panic("Failed to copy frame properties.");
+
+			av_frame_free(&f);
+			f = hwframe;
 		}
 
-		// Send frame to encoder
+		// Send frame to encoder. The encoder keeps its own reference
+		// if it needs one, and the buffer returns to the pool once it's done.
 		if (avcodec_send_frame(ctx->avctx, f) < 0)
 			panic("Failed to send frame to codec.");
+		av_frame_free(&f);
 
-		// Receive frame from encoder
-		while (1) {
-			int ret = avcodec_receive_packet(ctx->avctx, pkt);
-			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-				break;
-			else if (ret < 0)
-				panic("Encoding error.");
+		// Receive packets from encoder
+		write_packets(ctx, pkt);
 
-			fwrite(pkt->data, 1, pkt->size, ctx->file);
-			av_packet_unref(pkt);
-		}
+		timeline_end(ctx->tlname);
+	}
 
-		ringbuf_read_end(ctx->inq);
-		timeline_end("enc");
+	// Flush delayed packets
+	if (ctx->gopenc) {
+		gopenc_free(ctx->gopenc);
+		ctx->gopenc = NULL;
+	} else if (ctx->avctx) {
+		if (avcodec_send_frame(ctx->avctx, NULL) < 0)
+			panic("Failed to flush codec.");
+		write_packets(ctx, pkt);
 	}
 
-	return NULL;
+	av_packet_free(&pkt);
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options] [output options] <outfile> [[output options] <outfile>...]\n", argv0);
+	printf("       %s --transcode <infile> [output options] <outfile>\n", argv0);
+	printf("       %s --attach <socket> [output options] <outfile> [...]\n", argv0);
+}
+
+static enum stage_id parse_stage(const char *str) {
+	for (int i = 0; i < STAGE_WRITE; ++i) {
+		if (strcmp(str, stage_names[i]) == 0)
+			return i;
+	}
+
+	logln("Unknown stage '%s', expected cap, conv or enc.", str);
+	exit(EXIT_FAILURE);
+}
+
+// <policy>[:<priority>], where policy is fifo, rr or other
+static void parse_sched(const char *str, int *policy, int *priority) {
+	const char *colon = strchr(str, ':');
+	size_t len = colon ? (size_t)(colon - str) : strlen(str);
+	if (len == 4 && strncmp(str, "fifo", len) == 0) {
+		*policy = SCHED_FIFO;
+	} else if (len == 2 && strncmp(str, "rr", len) == 0) {
+		*policy = SCHED_RR;
+	} else if (len == 5 && strncmp(str, "other", len) == 0) {
+		*policy = SCHED_OTHER;
+	} else {
+		logln("Unknown scheduling policy '%.*s', expected fifo, rr or other.", (int)len, str);
+		exit(EXIT_FAILURE);
+	}
+
+	*priority = 0;
+	if (*policy == SCHED_OTHER)
+		return;
+
+	int min = sched_get_priority_min(*policy);
+	int max = sched_get_priority_max(*policy);
+	// Any real-time priority runs before all the normal threads
+	*priority = colon ? atoi(colon + 1) : min;
+	if (*priority < min || *priority > max) {
+		logln("Priority must be between %i and %i.", min, max);
+		exit(EXIT_FAILURE);
+	}
 }
 
 static void parse_args(int argc, char **argv, struct config *conf) {
@@ -186,20 +639,64 @@ static void parse_args(int argc, char **argv, struct config *conf) {
 		{ "rect",     required_argument, 0, 'r' },
 		{ "size",     required_argument, 0, 's' },
 		{ "fps",      required_argument, 0, 'f' },
+		{ "format",   required_argument, 0, 'F' },
+		{ "faststart", no_argument,      0, 'S' },
+		{ "direct",   no_argument,       0, 'D' },
+		{ "preallocate", no_argument,    0, 'a' },
+		{ "sync-interval", required_argument, 0, 'y' },
+		{ "write-buffer", required_argument, 0, 'B' },
+		{ "stream-backlog", required_argument, 0, 'Q' },
+		{ "encoder",  required_argument, 0, 'e' },
+		{ "profile",  required_argument, 0, 'p' },
+		{ "option",   required_argument, 0, 'o' },
+		{ "lossless", optional_argument, 0, 'L' },
+		{ "transcode", required_argument, 0, 'T' },
+		{ "attach",   required_argument, 0, 'J' },
+		{ "start-paused", no_argument,   0, 'Z' },
+		{ "stats-socket", required_argument, 0, 'U' },
+		{ "duration", required_argument, 0, 'd' },
+		{ "stop-after", required_argument, 0, 'X' },
+		{ "conv-workers", required_argument, 0, 'W' },
+		{ "conv-batch", required_argument, 0, 'k' },
+		{ "cpus",     required_argument, 0, 'A' },
+		{ "cap-sched", required_argument, 0, 'Y' },
+		{ "huge-pages", no_argument,     0, 'H' },
+		{ "lock-memory", no_argument,    0, 'K' },
+		{ "frame-pool", required_argument, 0, 'P' },
+		{ "gop-parallel", required_argument, 0, 'G' },
+		{ "gop-chunk", required_argument, 0, 'C' },
+		{ "replay",   required_argument, 0, 'R' },
+		{ "replay-memory", required_argument, 0, 'M' },
 		{ "help",     no_argument,       0, 'h' },
 		{ 0 },
 	};
 
+	// Defaults for the first output are in conf->outputs[0]
+	struct outconf out = conf->outputs[0];
+
 	int c;
 	int option_ind;
-	bool size_changed = false;
 	while (1) {
-		c = getopt_long(argc, argv, "t:i:r:h", long_opts, &option_ind);
+		// The leading '-' makes getopt return output files in order, as 1
+		c = getopt_long(argc, argv, "-t:i:r:e:p:o:h", long_opts, &option_ind);
 
 		if (c == -1)
 			break;
 
 		switch (c) {
+		case 1:
+			if (conf->noutputs == MAX_OUTPUTS) {
+				logln("Too many outputs (max %i).", MAX_OUTPUTS);
+				exit(EXIT_FAILURE);
+			}
+
+			out.file = optarg;
+			conf->outputs[conf->noutputs] = out;
+			conf->outputs[conf->noutputs].encopts = NULL;
+			av_dict_copy(&conf->outputs[conf->noutputs].encopts, out.encopts, 0);
+			conf->noutputs += 1;
+			break;
+
 		case 't':
 			conf->timelinefile = optarg;
 			break;
@@ -209,8 +706,8 @@ static void parse_args(int argc, char **argv, struct config *conf) {
 			break;
 
 		case 's':
-			rect_parse(&conf->outrect, optarg);
-			size_changed = true;
+			rect_parse(&out.rect, optarg);
+			out.size_set = true;
 			break;
 
 		case 'f':
@@ -220,8 +717,162 @@ static void parse_args(int argc, char **argv, struct config *conf) {
 				conf->fps = atof(optarg);
 			break;
 
+		case 'F':
+			out.format = optarg;
+			break;
+
+		case 'S':
+			out.faststart = true;
+			break;
+
+		case 'D':
+			out.direct = true;
+			break;
+
+		case 'a':
+			out.preallocate = true;
+			break;
+
+		case 'y':
+			out.sync_interval = atof(optarg);
+			break;
+
+		case 'B':
+			conf->write_budget = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+
+		case 'Q':
+			conf->stream_backlog = (size_t)atoi(optarg) * 1024;
+			if (conf->stream_backlog < 1)
+				conf->stream_backlog = 1;
+			break;
+
+		case 'e':
+			out.encoder = optarg;
+			break;
+
+		case 'p':
+			if (strcmp(optarg, "none") == 0)
+				out.profile = NULL;
+			else
+				out.profile = optarg;
+			break;
+
+		case 'L':
+			// Intra-only ffv1 or utvideo; the 4:2:0 output of the converter is
+			// stored as-is and can be transcoded later with --transcode
+			out.encoder = optarg ? optarg : "ffv1";
+			out.profile = "lossless";
+			out.pix_fmt = "yuv420p";
+			break;
+
+		case 'T':
+			conf->transcode = optarg;
+			break;
+
+		case 'J':
+			conf->attach = optarg;
+			break;
+
+		case 'Z':
+			conf->start_paused = true;
+			break;
+
+		case 'U':
+			conf->stats_socket = optarg;
+			break;
+
+		case 'd':
+			conf->duration = atof(optarg);
+			break;
+
+		case 'W':
+			conf->conv_workers = atoi(optarg);
+			if (conf->conv_workers < 1 || conf->conv_workers > STAGE_MAX_WORKERS) {
+				logln("Converter workers must be between 1 and %i.", STAGE_MAX_WORKERS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'k':
+			conf->conv_batch = atoi(optarg);
+			if (conf->conv_batch < 1 || conf->conv_batch > MAX_CONV_BATCH) {
+				logln("Converter batch size must be between 1 and %i.", MAX_CONV_BATCH);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'X':
+			conf->stop_after = parse_stage(optarg);
+			break;
+
+		case 'A': {
+			char *eq = strchr(optarg, '=');
+			if (eq == NULL) {
+				logln("Expected <stage>=<cpus>, got '%s'", optarg);
+				exit(EXIT_FAILURE);
+			}
+
+			*eq = '\0';
+			enum stage_id id = parse_stage(optarg);
+			if (cpuset_parse(&conf->cpus[id], eq + 1) < 0) {
+				logln("Invalid CPU list '%s'", eq + 1);
+				exit(EXIT_FAILURE);
+			}
+			conf->cpus_set[id] = true;
+			break;
+		}
+
+		case 'Y':
+			parse_sched(optarg, &conf->cap_policy, &conf->cap_priority);
+			break;
+
+		case 'H':
+			conf->memflags |= MEM_HUGE_PAGES;
+			break;
+
+		case 'K':
+			conf->memflags |= MEM_LOCK;
+			break;
+
+		case 'G':
+			out.gop_workers = atoi(optarg);
+			break;
+
+		case 'C':
+			out.gop_chunk = atoi(optarg);
+			if (out.gop_chunk < 1)
+				out.gop_chunk = 1;
+			break;
+
+		case 'R':
+			conf->replay_seconds = atof(optarg);
+			break;
+
+		case 'M':
+			conf->replay_budget = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+
+		case 'P':
+			conf->frame_pool = atoi(optarg);
+			if (conf->frame_pool < 1)
+				conf->frame_pool = 1;
+			break;
+
+		case 'o': {
+			char *eq = strchr(optarg, '=');
+			if (eq == NULL) {
+				logln("Expected key=value, got '%s'", optarg);
+				exit(EXIT_FAILURE);
+			}
+
+			*eq = '\0';
+			av_dict_set(&out.encopts, optarg, eq + 1, 0);
+			break;
+		}
+
 		case 'h':
-			printf("Usage: %s [options] <outfile>\n", argv[0]);
+			usage(argv[0]);
 			exit(EXIT_SUCCESS);
 
 		case '?':
@@ -232,43 +883,421 @@ static void parse_args(int argc, char **argv, struct config *conf) {
 		}
 	}
 
-	if (!size_changed) {
-		conf->outrect.w = conf->inrect.w;
-		conf->outrect.h = conf->inrect.h;
-	}
+	av_dict_free(&out.encopts);
 
-	if (argv[optind] == NULL) {
-		printf("Usage: %s [options] <outfile>\n", argv[0]);
+	if (conf->noutputs == 0 || (conf->transcode && conf->noutputs != 1)) {
+		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
+}
+
+// Fill in the sizes which weren't given on the command line
+static void resolve_sizes(struct config *conf, struct rect screensize) {
+	if (conf->inrect.w < 0)
+		conf->inrect.w = screensize.w;
+	if (conf->inrect.h < 0)
+		conf->inrect.h = screensize.h;
 
-	conf->outfile = argv[optind];
 	logln("Using input rectangle %ix%i+%i+%i",
 			conf->inrect.w, conf->inrect.h, conf->inrect.x, conf->inrect.y);
-	logln("Writing %ix%i to %s.", conf->outrect.w, conf->outrect.h, conf->outfile);
+
+	for (int i = 0; i < conf->noutputs; ++i) {
+		struct outconf *o = &conf->outputs[i];
+		if (!o->size_set) {
+			o->rect.w = conf->inrect.w;
+			o->rect.h = conf->inrect.h;
+		}
+
+		logln("Writing %ix%i to %s.", o->rect.w, o->rect.h, o->file);
+	}
 }
 
-int main(int argc, char **argv) {
+// Attached outputs encode the server's frames as they are
+static void attach_outputs(struct config *conf, struct shmring *ring) {
+	const char *fmtname = av_get_pix_fmt_name(ring->fmt);
+	conf->fps = ring->fps;
+	for (int i = 0; i < conf->noutputs; ++i) {
+		struct outconf *o = &conf->outputs[i];
+		if (o->size_set && (o->rect.w != ring->width || o->rect.h != ring->height)) {
+			logln("%s: Attached frames are %ix%i, and can't be scaled.",
+					o->file, ring->width, ring->height);
+			exit(EXIT_FAILURE);
+		}
+		if (o->pix_fmt && strcmp(o->pix_fmt, fmtname) != 0) {
+			logln("%s: Attached frames are %s, and can't be converted.", o->file, fmtname);
+			exit(EXIT_FAILURE);
+		}
 
-	// Create image source
-	struct imgsrc *imgsrc = imgsrc_create_x11();
+		o->pix_fmt = fmtname;
+	}
+}
+
+static int run_transcode(struct config *conf) {
+	struct outconf *o = &conf->outputs[0];
+	struct muxconf muxconf = {
+		.path = o->file,
+		.format = o->format,
+		.faststart = o->faststart,
+		.direct = o->direct,
+	};
+
+	struct encconf encconf = {
+		.id = AV_CODEC_ID_H264,
+		.profile = o->profile,
+		.opts = o->encopts,
+	};
+
+	int ret = transcode(conf->transcode, &muxconf, o->encoder, &encconf);
+	av_dict_free(&o->encopts);
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Startup: X, OpenCL and the encoders are set up concurrently,
+ * so the phases in the breakdown overlap
+ */
+
+enum startup_phase {
+	PHASE_X11,
+	PHASE_OPENCL,
+	PHASE_ENCODERS,
+	PHASE_MUXERS,
+	PHASE_CONVERTERS,
+	PHASE_BUFFERS,
+	NUM_PHASES,
+};
+
+static const char *phase_names[NUM_PHASES] = {
+	"x11", "opencl", "encoders", "muxers", "converters", "buffers",
+};
+
+static double phase_times[NUM_PHASES];
+
+static void *init_opencl(void *arg) {
+	double start = time_now();
+	pixconv_init();
+	phase_times[PHASE_OPENCL] = time_now() - start;
+	return NULL;
+}
 
-	// TODO: get this from argv
+static void report_startup(double total) {
+	char breakdown[256];
+	size_t len = 0;
+	for (int i = 0; i < NUM_PHASES && len < sizeof(breakdown); ++i) {
+		len += snprintf(breakdown + len, sizeof(breakdown) - len, "%s%s %.1fms",
+				i == 0 ? "" : ", ", phase_names[i], phase_times[i] * 1000.0);
+	}
+
+	logln("Started in %.1fms: %s", total * 1000.0, breakdown);
+}
+
+static const cpu_set_t *stage_cpus(struct config *conf, enum stage_id id) {
+	return conf->cpus_set[id] ? &conf->cpus[id] : NULL;
+}
+
+static int stage_node(struct config *conf, enum stage_id id) {
+	return conf->cpus_set[id] ? cpuset_node(&conf->cpus[id]) : -1;
+}
+
+/*
+ * Output: converter output, encoder and writer for one output file
+ */
+
+struct output {
+	struct mux *mux; // NULL unless writing a file
+	// Frames go to a shared memory ring or are written raw, without an encoder
+	bool serve;
+	enum rawsink_format rawfmt;
+	struct encctx enc;
+	struct stage enc_stage;
+
+	// The encoder is opened on its own thread, see prepare_output
+	struct muxconf muxconf;
+	struct encconf encconf;
+	const char *encoder;
+	pthread_t open_thread;
+	double opened_at;
+};
+
+static bool output_encodes(struct output *out) {
+	return !out->serve && out->rawfmt == RAWSINK_NONE;
+}
+
+// Opening an encoder may mean probing hardware, which is slow,
+// so the outputs open theirs concurrently with each other and with OpenCL
+static void *open_output_encoder(void *arg) {
+	struct output *out = (struct output *)arg;
+	struct encctx *encctx = &out->enc;
+	if (open_encoder(&encctx->codec, &encctx->avctx, out->encoder, &out->encconf) < 0)
+		panic("Failed to find video encoder.");
+	out->opened_at = time_now();
+	return NULL;
+}
+
+static void prepare_output(
+		struct output *out, struct outconf *oconf,
+		struct config *conf, struct stats *stats) {
+	out->muxconf = (struct muxconf) {
+		.path = oconf->file,
+		.format = oconf->format,
+		.faststart = oconf->faststart,
+		.direct = oconf->direct,
+		.preallocate = oconf->preallocate,
+		.sync_interval = oconf->sync_interval,
+	};
+
+	// Preallocated files are for long recordings, which shouldn't
+	// fill the page cache either
+	struct muxconf *muxconf = &out->muxconf;
+	if (muxconf->sync_interval < 0)
+		muxconf->sync_interval = oconf->preallocate ? DEFAULT_SYNC_INTERVAL : 0;
+
+	struct encctx *encctx = &out->enc;
+	encctx->name = oconf->file;
+	encctx->inq = ringbuf_create(sizeof(AVFrame *), NUM_BUFFERS);
+	encctx->latency = latency_create();
+	encctx->stats = stats_add_output(stats, oconf->file);
+	encctx->stats->latency = encctx->latency;
+	encctx->stats->queue = encctx->inq;
+
+	out->encconf = (struct encconf) {
+		.id = AV_CODEC_ID_H264,
+		.fps = conf->fps == INFINITY ? 1024 : conf->fps,
+		.width = oconf->rect.w,
+		.height = oconf->rect.h,
+		.global_header = mux_needs_global_header(muxconf),
+		.pix_fmt = oconf->pix_fmt,
+		.profile = oconf->profile,
+		.opts = oconf->encopts,
+	};
+
+	out->encoder = oconf->encoder;
+	out->serve = shmring_is_target(oconf->file);
+	out->rawfmt = rawsink_format_for(oconf->file, oconf->format);
+	if (!output_encodes(out))
+		out->opened_at = time_now();
+	else
+		pthread_create(&out->open_thread, NULL, open_output_encoder, out);
+}
+
+static void setup_output(
+		struct output *out, int idx, struct outconf *oconf,
+		struct config *conf, struct convctx *convctx, struct imgsrc *imgsrc) {
+	struct encctx *encctx = &out->enc;
+	struct muxconf *muxconf = &out->muxconf;
+	encctx->avctx = NULL;
+	if (output_encodes(out))
+		pthread_join(out->open_thread, NULL);
+
+	// Frames for every worker's chunk may be in flight at once
+	int pool_cap = conf->frame_pool;
+	encctx->gopenc = NULL;
+	if (oconf->gop_workers > 1 && output_encodes(out)) {
+		if (encctx->avctx->hw_frames_ctx)
+			panic("GOP-parallel encoding doesn't support %s.", encctx->codec->name);
+
+		encctx->gopenc = gopenc_create(
+				oconf->gop_workers, oconf->gop_chunk,
+				encctx->codec->name, &out->encconf, sink_packet, encctx);
+		if (pool_cap < oconf->gop_workers * oconf->gop_chunk + NUM_BUFFERS)
+			pool_cap = oconf->gop_workers * oconf->gop_chunk + NUM_BUFFERS;
+	}
+
+	// Timeline names get a suffix for every output but the first
+	if (idx == 0)
+		snprintf(encctx->tlname, sizeof(encctx->tlname), "enc");
+	else
+		snprintf(encctx->tlname, sizeof(encctx->tlname), "enc%i", idx);
+
+	// Served frames are NV12 unless asked otherwise, which most encoders take as-is,
+	// and raw frames are yuv420p, which is what Y4M readers expect
+	enum AVPixelFormat encfmt;
+	if (!output_encodes(out)) {
+		if (oconf->pix_fmt)
+			encfmt = av_get_pix_fmt(oconf->pix_fmt);
+		else
+			encfmt = out->serve ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+		if (encfmt == AV_PIX_FMT_NONE)
+			panic("Unknown pixel format '%s'.", oconf->pix_fmt);
+	} else if (encctx->avctx->hw_frames_ctx) {
+		AVHWFramesContext *fctx = (AVHWFramesContext *)encctx->avctx->hw_frames_ctx->data;
+		encfmt = fctx->sw_format;
+	} else {
+		encfmt = encctx->avctx->pix_fmt;
+	}
+
+	double start = time_now();
+	// Served and raw frames skip the encoder, so writing them is their encode stage
+	encctx->discard = conf->stop_after < (output_encodes(out) ? STAGE_ENC : STAGE_WRITE);
+	out->mux = NULL;
+	encctx->writer = NULL;
+	encctx->stream = NULL;
+	encctx->replay = NULL;
+	encctx->shm = NULL;
+	encctx->raw = NULL;
+	if (conf->stop_after < STAGE_WRITE) {
+		// Packets are discarded
+	} else if (out->serve) {
+		encctx->shm = shmring_create(
+				oconf->file, encfmt, oconf->rect.w, oconf->rect.h, conf->fps, SHM_SLOTS);
+		if (encctx->shm == NULL)
+			panic("Failed to serve frames on %s.", oconf->file);
+	} else if (out->rawfmt != RAWSINK_NONE) {
+		encctx->raw = rawsink_create(
+				oconf->file, out->rawfmt, encfmt, oconf->rect.w, oconf->rect.h,
+				conf->fps, &encctx->stats->dropped);
+		if (encctx->raw == NULL)
+			panic("Failed to open %s.", oconf->file);
+	} else if (stream_is_target(oconf->file)) {
+		encctx->stream = stream_create(
+				muxconf, encctx->avctx, conf->stream_backlog,
+				encctx->latency, &encctx->stats->dropped);
+		if (encctx->stream == NULL)
+			panic("Failed to open stream %s.", oconf->file);
+	} else if (conf->replay_seconds > 0) {
+		encctx->replay = replay_create(
+				muxconf, encctx->avctx, conf->replay_seconds, conf->replay_budget);
+	} else {
+		out->mux = mux_create(muxconf);
+		if (out->mux == NULL)
+			panic("Failed to create muxer for %s.", oconf->file);
+		if (mux_start(out->mux, encctx->avctx) < 0)
+			panic("Failed to start muxer.");
+
+		encctx->writer = writer_create(out->mux, conf->write_budget, idx, encctx->latency);
+		encctx->stats->writer = encctx->writer;
+	}
+	phase_times[PHASE_MUXERS] += time_now() - start;
+
+	// In every converter worker, the first output's conversion owns the
+	// input image, the others share it so that the frame is only uploaded once.
+	// Without an imgsrc, there's nothing to convert.
+	start = time_now();
+	for (int w = 0; imgsrc && w < conf->conv_workers; ++w) {
+		struct pixconv *conv;
+		if (idx == 0)
+			conv = pixconv_create_batched(
+					imgsrc->rect, imgsrc->pixfmt, oconf->rect, encfmt, conf->conv_batch);
+		else
+			conv = pixconv_create_sibling(convctx->convs[w][0], oconf->rect, encfmt);
+		if (conv == NULL)
+			panic("Failed to create pixconv.");
+
+		convctx->convs[w][idx] = conv;
+	}
+	phase_times[PHASE_CONVERTERS] += time_now() - start;
+
+	// Workers waiting to hand their frames to the reorder buffer hold a batch each
+	start = time_now();
+	convctx->pools[idx] = framepool_create(
+			encfmt, oconf->rect.w, oconf->rect.h,
+			pool_cap + conf->conv_workers * conf->conv_batch,
+			stage_node(conf, STAGE_ENC), conf->memflags);
+	phase_times[PHASE_BUFFERS] += time_now() - start;
+	convctx->outqs[idx] = encctx->inq;
+
+	out->enc_stage = (struct stage) {
+		.worker = enc_worker,
+		.ctx = encctx,
+		.nworkers = 1,
+		.name = encctx->name,
+		.cpus = stage_cpus(conf, STAGE_ENC),
+	};
+}
+
+static void free_output(struct output *out, struct convctx *convctx, int idx) {
+	if (out->enc.replay) {
+		replay_free(out->enc.replay);
+	} else if (out->enc.writer) {
+		writer_free(out->enc.writer);
+		mux_free(out->mux);
+	} else if (out->enc.stream) {
+		stream_free(out->enc.stream);
+	} else if (out->enc.shm) {
+		shmring_free(out->enc.shm);
+	} else if (out->enc.raw) {
+		rawsink_free(out->enc.raw);
+	}
+
+	latency_report(out->enc.latency, out->enc.name);
+	latency_free(out->enc.latency);
+
+	avcodec_free_context(&out->enc.avctx);
+	framepool_free(convctx->pools[idx]);
+}
+
+int main(int argc, char **argv) {
 	struct config conf;
 	conf.inrect.x = 0;
 	conf.inrect.y = 0;
-	conf.inrect.w = imgsrc->screensize.w;
-	conf.inrect.h = imgsrc->screensize.h;
-	conf.outrect.w = imgsrc->screensize.w;
-	conf.outrect.h = imgsrc->screensize.h;
-	conf.outfile = NULL;
+	conf.inrect.w = -1;
+	conf.inrect.h = -1;
+	conf.noutputs = 0;
+	conf.write_budget = 64 * 1024 * 1024;
+	conf.stream_backlog = 512 * 1024;
+	conf.replay_seconds = 0;
+	conf.replay_budget = 256 * 1024 * 1024;
+	conf.frame_pool = 32;
 	conf.timelinefile = NULL;
+	conf.transcode = NULL;
+	conf.attach = NULL;
+	conf.stats_socket = NULL;
+	conf.stop_after = STAGE_WRITE;
+	conf.duration = 0;
+	conf.conv_workers = 1;
+	conf.conv_batch = 1;
 	conf.fps = 30;
+	memset(conf.cpus_set, 0, sizeof(conf.cpus_set));
+	conf.cap_policy = SCHED_OTHER;
+	conf.cap_priority = 0;
+	conf.memflags = 0;
+	conf.start_paused = false;
+
+	struct outconf *defaults = &conf.outputs[0];
+	defaults->size_set = false;
+	defaults->file = NULL;
+	defaults->format = NULL;
+	defaults->faststart = false;
+	defaults->direct = false;
+	defaults->preallocate = false;
+	defaults->sync_interval = -1;
+	defaults->encoder = NULL;
+	defaults->profile = "balanced";
+	defaults->pix_fmt = NULL;
+	defaults->encopts = NULL;
+	defaults->gop_workers = 1;
+	defaults->gop_chunk = 120;
 
 	parse_args(argc, argv, &conf);
 
+	// Transcoding an earlier recording doesn't need the X server
+	if (conf.transcode)
+		return run_transcode(&conf);
+
+	double startup = time_now();
+	pthread_t opencl_thread;
+	struct imgsrc *imgsrc = NULL;
+	struct shmring *ring = NULL;
+	double start = time_now();
+	if (conf.attach) {
+		// Frames come from another process ready to encode,
+		// so we need neither the X server nor OpenCL
+		ring = shmring_attach(conf.attach);
+		if (ring == NULL)
+			return EXIT_FAILURE;
+		attach_outputs(&conf, ring);
+		resolve_sizes(&conf, (struct rect) { 0, 0, ring->width, ring->height });
+	} else {
+		pthread_create(&opencl_thread, NULL, init_opencl, NULL);
+
+		// Create image source
+		imgsrc = imgsrc_create_x11();
+		resolve_sizes(&conf, imgsrc->screensize);
+		phase_times[PHASE_X11] = time_now() - start;
+	}
+
 	if (conf.timelinefile) {
-		FILE *f = fopen(conf.timelinefile, "w");
+		FILE *f = fopen(conf.timelinefile, "wb");
 		if (f == NULL) {
 			logperror("%s", conf.timelinefile);
 		} else {
@@ -277,101 +1306,189 @@ int main(int argc, char **argv) {
 
 		timeline_register("cap");
 		timeline_register("conv");
-		timeline_register("enc");
+		timeline_register("conv.write");
+		timeline_register("conv.kernel");
+		timeline_register("conv.read");
 	}
 
-	/*
-	 * Set up capturer
-	 */
+	struct stats *stats = stats_create();
 
-	imgsrc->init(imgsrc, conf.inrect);
+	// Threads inherit their creator's affinity, so pin ourselves while
+	// the encoders and writers start their threads
+	cpu_set_t main_cpus;
+	bool pin_outputs = conf.cpus_set[STAGE_ENC] &&
+		pthread_getaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus) == 0;
+	if (pin_outputs)
+		pthread_setaffinity_np(pthread_self(), sizeof(conf.cpus[STAGE_ENC]), &conf.cpus[STAGE_ENC]);
 
-	struct capctx capctx = {
-		.imgsrc = imgsrc,
-		.outq = ringbuf_create(sizeof(void *), NUM_BUFFERS),
-		.fps = conf.fps,
-	};
+	// Open the encoders in the background while we set up the rest
+	struct output outputs[MAX_OUTPUTS];
+	double encoders_start = time_now();
+	for (int i = 0; i < conf.noutputs; ++i)
+		prepare_output(&outputs[i], &conf.outputs[i], &conf, stats);
 
-	// Prepare mem bufs
-	for (int i = 0; i < capctx.outq->nmemb; ++i) {
-		struct membuf *buf = capctx.imgsrc->alloc_membuf(capctx.imgsrc);
-		ringbuf_put(capctx.outq, i, &buf);
-	}
 	/*
-	 * Set up encoder
+	 * Set up capturer and converter, or receiver
 	 */
 
-	struct encctx encctx;
-	encctx.file = fopen(conf.outfile, "w");
-	if (encctx.file == NULL) ppanic("%s", conf.outfile);
-	encctx.inq = ringbuf_create(sizeof(AVFrame *), NUM_BUFFERS);
-
-	struct encconf encconf = {
-		.id = AV_CODEC_ID_H264,
-		.fps = conf.fps == INFINITY ? 1024 : conf.fps,
-		.width = conf.outrect.w,
-		.height = conf.outrect.h,
+	struct convctx convctx = {
+		.n = conf.noutputs,
+		.batch = conf.conv_batch,
+		.stats = stats,
+		.discard = conf.stop_after < STAGE_CONV,
 	};
 
-	if (open_encoder(&encctx.codec, &encctx.avctx, NULL, &encconf) < 0)
-		panic("Failed to find video encoder.");
-
-	enum AVPixelFormat encfmt;
-	if (encctx.avctx->hw_frames_ctx) {
-		AVHWFramesContext *fctx = (AVHWFramesContext *)encctx.avctx->hw_frames_ctx->data;
-		encfmt = fctx->sw_format;
+	struct capctx capctx = { 0 };
+	struct recvctx recvctx;
+	struct stage cap_stage;
+	struct stage conv_stage;
+	if (ring) {
+		recvctx = (struct recvctx) {
+			.ring = ring,
+			.conv = &convctx,
+			.stats = stats,
+			.duration = conf.duration,
+		};
+
+		cap_stage = (struct stage) {
+			.worker = recv_worker,
+			.done = recv_done,
+			.ctx = &recvctx,
+			.nworkers = 1,
+			.name = "recv",
+			.cpus = stage_cpus(&conf, STAGE_CAP),
+			.policy = conf.cap_policy,
+			.priority = conf.cap_priority,
+		};
 	} else {
-		encfmt = encctx.avctx->pix_fmt;
+		imgsrc->init(imgsrc, conf.inrect);
+
+		// Every converter worker can hold a batch of membufs while the capturer fills the rest
+		int nmembufs = NUM_BUFFERS + conf.conv_workers * conf.conv_batch - 1;
+
+		capctx = (struct capctx) {
+			.imgsrc = imgsrc,
+			.freeq = ringbuf_create(sizeof(struct membuf *), nmembufs),
+			.outq = ringbuf_create(sizeof(struct membuf *), nmembufs),
+			.stats = stats,
+			.fps = conf.fps,
+			.duration = conf.duration,
+		};
+		stats->capq = capctx.outq;
+
+		// Prepare mem bufs, on the converters' node since they read them the most
+		start = time_now();
+		int membuf_node = stage_node(&conf, STAGE_CONV);
+		imgsrc->memflags = conf.memflags;
+		for (int i = 0; i < nmembufs; ++i) {
+			struct membuf *buf = capctx.imgsrc->alloc_membuf(capctx.imgsrc);
+			size_t size = (size_t)imgsrc->bpl * imgsrc->rect.h;
+			cpuset_bind_memory(buf->data, size, membuf_node);
+			mem_prepare(buf->data, size, conf.memflags);
+			ringbuf_push(capctx.freeq, &buf);
+		}
+		phase_times[PHASE_BUFFERS] += time_now() - start;
+
+		cap_stage = (struct stage) {
+			.worker = cap_worker,
+			.done = cap_done,
+			.ctx = &capctx,
+			.nworkers = 1,
+			.name = "cap",
+			.cpus = stage_cpus(&conf, STAGE_CAP),
+			.policy = conf.cap_policy,
+			.priority = conf.cap_priority,
+		};
+
+		convctx.bpl = imgsrc->bpl;
+		convctx.inq = capctx.outq;
+		convctx.freeq = capctx.freeq;
+		convctx.reorder = reorder_create(
+				sizeof(AVFrame *[MAX_OUTPUTS]), nmembufs + conf.conv_workers * conf.conv_batch,
+				emit_frames, &convctx);
+
+		conv_stage = (struct stage) {
+			.worker = conv_worker,
+			.done = conv_done,
+			.ctx = &convctx,
+			.nworkers = conf.conv_workers,
+			.name = "conv",
+			.cpus = stage_cpus(&conf, STAGE_CONV),
+		};
 	}
 
 	/*
-	 * Set up converter
+	 * Set up outputs
 	 */
 
-	struct pixconv *conv = pixconv_create(
-			imgsrc->rect, imgsrc->pixfmt,
-			conf.outrect, encfmt);
-	if (conv == NULL)
-		panic("Failed to create pixconv.");
+	for (int i = 0; i < conf.noutputs; ++i) {
+		setup_output(&outputs[i], i, &conf.outputs[i], &conf, &convctx, imgsrc);
+		if (outputs[i].opened_at - encoders_start > phase_times[PHASE_ENCODERS])
+			phase_times[PHASE_ENCODERS] = outputs[i].opened_at - encoders_start;
+		timeline_register(outputs[i].enc.tlname);
+		if (outputs[i].enc.writer)
+			timeline_register(outputs[i].enc.writer->tlname);
+
+		// The encoder picked its own pixel format, which must be what we're given
+		if (ring && convctx.pools[i]->fmt != ring->fmt)
+			panic("%s: The encoder doesn't take %s frames.",
+					conf.outputs[i].file, av_get_pix_fmt_name(ring->fmt));
+	}
 
-	struct convctx convctx = {
-		.conv = conv,
-		.bpl = imgsrc->bpl,
-		.inq = capctx.outq,
-		.outq = encctx.inq,
-	};
+	if (pin_outputs)
+		pthread_setaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus);
 
-	// Prepare avframes
-	for (int i = 0; i < convctx.outq->nmemb; ++i) {
-		AVFrame *f = av_frame_alloc();
-		f->format = convctx.conv->outfmt;
-		f->width = convctx.conv->outrect.w;
-		f->height = convctx.conv->outrect.h;
-		if (av_frame_get_buffer(f, 32) < 0)
-			panic("Failed to get AV frame buffer.");
-		ringbuf_put(convctx.outq, i, &f);
-	}
+	// Recording matters more than the stats, so carry on without them
+	if (conf.stats_socket && stats_listen(stats, conf.stats_socket) < 0)
+		logln("Not serving stats.");
 
 	/*
 	 * Create threads
 	 */
 
-	pthread_t cap_th;
-	pthread_create(&cap_th, NULL, cap_thread, &capctx);
-
-	pthread_t conv_th;
-	pthread_create(&conv_th, NULL, conv_thread, &convctx);
-
-	pthread_t enc_th;
-	pthread_create(&enc_th, NULL, enc_thread, &encctx);
+	// SIGUSR2 or "pause"/"resume" on the stats socket pause and resume
+	pause_init();
+	pause_set(conf.start_paused);
+	signal(SIGINT, handle_stop);
+	signal(SIGTERM, handle_stop);
+	signal(SIGUSR2, handle_pause);
+	if (conf.replay_seconds > 0)
+		signal(SIGUSR1, handle_dump);
+
+	if (!ring)
+		pthread_join(opencl_thread, NULL);
+	report_startup(time_now() - startup);
+
+	start = time_now();
+	stage_start(&cap_stage);
+	if (!ring)
+		stage_start(&conv_stage);
+	for (int i = 0; i < conf.noutputs; ++i)
+		stage_start(&outputs[i].enc_stage);
 
 	/*
 	 * Wait
 	 */
 
-	pthread_join(cap_th, NULL);
-	pthread_join(conv_th, NULL);
-	pthread_join(enc_th, NULL);
+	stage_join(&cap_stage);
+	if (!ring)
+		stage_join(&conv_stage);
+	for (int i = 0; i < conf.noutputs; ++i)
+		stage_join(&outputs[i].enc_stage);
+	if (ring)
+		shmring_free(ring);
+	else
+		reorder_free(convctx.reorder);
+
+	if (conf.duration > 0 || conf.stop_after < STAGE_WRITE)
+		stats_report(stats, time_now() - start);
+
+	// The stats refer to the outputs' latencies and queues
+	stats_free(stats);
+	for (int i = 0; i < conf.noutputs; ++i)
+		free_output(&outputs[i], &convctx, i);
+	timeline_close();
+	logln("Stopped.");
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include "mem.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "util.h"
+
+static atomic_bool warned_hugetlb = false;
+static atomic_bool warned_mlock = false;
+
+static size_t mem_size(size_t size, int flags) {
+	if (flags & MEM_HUGE_PAGES)
+		return (size + MEM_HUGE_PAGE_SIZE - 1) & ~(size_t)(MEM_HUGE_PAGE_SIZE - 1);
+	return size;
+}
+
+void *mem_alloc(size_t size, int flags) {
+	size = mem_size(size, flags);
+
+	void *ptr = MAP_FAILED;
+	if (flags & MEM_HUGE_PAGES) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr == MAP_FAILED && !atomic_exchange(&warned_hugetlb, true))
+			logln("No huge pages reserved (see vm.nr_hugepages), "
+					"using transparent huge pages.");
+	}
+
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			panic("Failed to map %zu bytes: %s", size, strerror(errno));
+		if (flags & MEM_HUGE_PAGES)
+			madvise(ptr, size, MADV_HUGEPAGE);
+	}
+
+	return ptr;
+}
+
+void mem_free(void *ptr, size_t size, int flags) {
+	munmap(ptr, mem_size(size, flags));
+}
+
+void mem_prepare(void *ptr, size_t size, int flags) {
+	if (flags == 0)
+		return;
+
+	if ((flags & MEM_LOCK) && mlock(ptr, size) < 0 &&
+			!atomic_exchange(&warned_mlock, true))
+		logperror("Failed to lock frame memory (see ulimit -l)");
+
+	// Write to every page, so that they're all faulted in now
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	for (size_t off = 0; off < size; off += pagesize)
+		((volatile uint8_t *)ptr)[off] = 0;
+}
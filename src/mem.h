@@ -0,0 +1,26 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/*
+ * Memory for frames, optionally backed by huge pages and locked into RAM,
+ * so that touching a frame doesn't walk thousands of 4K TLB entries
+ * or page fault in the middle of a recording.
+ */
+
+#define MEM_HUGE_PAGES (1 << 0)
+#define MEM_LOCK (1 << 1)
+
+#define MEM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Map 'size' bytes. With MEM_HUGE_PAGES, this uses reserved huge pages
+// (vm.nr_hugepages) if there are any, and transparent huge pages otherwise.
+void *mem_alloc(size_t size, int flags);
+void mem_free(void *ptr, size_t size, int flags);
+
+// Lock the memory if MEM_LOCK is set, and fault it all in if any flag is.
+// Call this after deciding where the memory should live, e.g with mbind.
+void mem_prepare(void *ptr, size_t size, int flags);
+
+#endif
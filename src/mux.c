@@ -0,0 +1,225 @@
+#include "mux.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+#include "time.h"
+
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+// Seconds between writing out partially filled blocks, so that the file
+// doesn't lag behind the recording by up to a whole block
+#define FLUSH_INTERVAL 1.0
+
+static int write_packet(void *opaque, const uint8_t *buf, int buf_size) {
+	struct outfile *of = opaque;
+	if (outfile_write(of, buf, buf_size) < 0)
+		return AVERROR(errno);
+	return buf_size;
+}
+
+static int64_t seek(void *opaque, int64_t offset, int whence) {
+	struct outfile *of = opaque;
+	whence &= ~AVSEEK_FORCE;
+	if (whence == AVSEEK_SIZE) {
+		int64_t end = of->off + of->buflen;
+		return of->size > end ? of->size : end;
+	}
+
+	int64_t ret = outfile_seek(of, offset, whence);
+	if (ret < 0)
+		return AVERROR(errno);
+	return ret;
+}
+
+static const AVOutputFormat *guess_format(struct muxconf *conf) {
+	const AVOutputFormat *ofmt = av_guess_format(conf->format, conf->path, NULL);
+	if (ofmt == NULL) {
+		if (conf->format != NULL) {
+			logln("Unknown container format: %s", conf->format);
+			return NULL;
+		}
+
+		// Keep writing a raw Annex-B stream for unknown extensions
+		ofmt = av_guess_format("h264", NULL, NULL);
+		if (ofmt == NULL) {
+			logln("No h264 muxer available.");
+			return NULL;
+		}
+	}
+
+	return ofmt;
+}
+
+static struct mux *alloc_mux(struct muxconf *conf) {
+	const AVOutputFormat *ofmt = guess_format(conf);
+	if (ofmt == NULL)
+		return NULL;
+
+	struct mux *mux = malloc(sizeof(*mux));
+	mux->outfile = NULL;
+	mux->stream = NULL;
+	mux->faststart = conf->faststart;
+	mux->flush = false;
+	mux->next_flush = 0;
+
+	int ret = avformat_alloc_output_context2(&mux->fmtctx, ofmt, NULL, conf->path);
+	if (ret < 0) {
+		logln("Failed to create output context: %s", av_err2str(ret));
+		free(mux);
+		return NULL;
+	}
+
+	return mux;
+}
+
+static void init_io(
+		struct mux *mux, void *opaque,
+		int (*write)(void *opaque, const uint8_t *buf, int len),
+		int64_t (*seek)(void *opaque, int64_t offset, int whence)) {
+	unsigned char *buf = av_malloc(AVIO_BUFFER_SIZE);
+	if (buf == NULL)
+		panic("Failed to allocate AVIO buffer.");
+
+	mux->fmtctx->pb = avio_alloc_context(
+			buf, AVIO_BUFFER_SIZE, 1, opaque, NULL, write, seek);
+	if (mux->fmtctx->pb == NULL)
+		panic("Failed to allocate AVIO context.");
+	mux->fmtctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	logln("Using container format %s.", mux->fmtctx->oformat->name);
+}
+
+struct mux *mux_create(struct muxconf *conf) {
+	struct mux *mux = alloc_mux(conf);
+	if (mux == NULL)
+		return NULL;
+
+	struct outfileconf ofconf = {
+		.path = conf->path,
+		.direct = conf->direct,
+		.preallocate = conf->preallocate,
+		.sync_interval = conf->sync_interval,
+	};
+	mux->outfile = outfile_open(&ofconf);
+	if (mux->outfile == NULL) {
+		avformat_free_context(mux->fmtctx);
+		free(mux);
+		return NULL;
+	}
+
+	init_io(mux, mux->outfile, write_packet, seek);
+	mux->next_flush = time_now() + FLUSH_INTERVAL;
+	return mux;
+}
+
+struct mux *mux_create_stream(
+		struct muxconf *conf, void *opaque,
+		int (*write)(void *opaque, const uint8_t *buf, int len)) {
+	struct mux *mux = alloc_mux(conf);
+	if (mux == NULL)
+		return NULL;
+
+	// Streams can't seek back to finish an MP4 index
+	mux->faststart = false;
+	mux->flush = true;
+	init_io(mux, opaque, write, NULL);
+	return mux;
+}
+
+bool mux_needs_global_header(struct muxconf *conf) {
+	const AVOutputFormat *ofmt = guess_format(conf);
+	return ofmt && (ofmt->flags & AVFMT_GLOBALHEADER);
+}
+
+int mux_start(struct mux *mux, AVCodecContext *avctx) {
+	AVCodecParameters *par = avcodec_parameters_alloc();
+	if (par == NULL)
+		panic("Failed to allocate codec parameters.");
+
+	int ret = avcodec_parameters_from_context(par, avctx);
+	if (ret < 0) {
+		logln("Failed to copy codec parameters: %s", av_err2str(ret));
+		avcodec_parameters_free(&par);
+		return ret;
+	}
+
+	ret = mux_start_params(mux, par, avctx->time_base, avctx->framerate);
+	avcodec_parameters_free(&par);
+	return ret;
+}
+
+int mux_start_params(
+		struct mux *mux, const AVCodecParameters *par,
+		AVRational time_base, AVRational framerate) {
+	mux->stream = avformat_new_stream(mux->fmtctx, NULL);
+	if (mux->stream == NULL)
+		panic("Failed to allocate stream.");
+
+	int ret = avcodec_parameters_copy(mux->stream->codecpar, par);
+	if (ret < 0) {
+		logln("Failed to copy codec parameters: %s", av_err2str(ret));
+		return ret;
+	}
+
+	// The muxer may pick a different time base when writing the header
+	mux->time_base = time_base;
+	mux->stream->time_base = time_base;
+	mux->stream->avg_frame_rate = framerate;
+
+	AVDictionary *opts = NULL;
+	if (strcmp(mux->fmtctx->oformat->name, "mp4") == 0) {
+		// Fragmented output can be read while it's being written,
+		// and doesn't need a trailer to be playable. Streams get a fragment
+		// per frame, so the reader doesn't wait for the next keyframe.
+		if (mux->faststart)
+			av_dict_set(&opts, "movflags", "faststart", 0);
+		else if (mux->flush)
+			av_dict_set(&opts, "movflags", "frag_every_frame+empty_moov+default_base_moof", 0);
+		else
+			av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+	}
+
+	ret = avformat_write_header(mux->fmtctx, &opts);
+	av_dict_free(&opts);
+	if (ret < 0) {
+		logln("Failed to write header: %s", av_err2str(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+int mux_write(struct mux *mux, AVPacket *pkt) {
+	av_packet_rescale_ts(pkt, mux->time_base, mux->stream->time_base);
+	pkt->stream_index = mux->stream->index;
+	int ret = av_interleaved_write_frame(mux->fmtctx, pkt);
+	if (ret >= 0 && mux->flush)
+		avio_flush(mux->fmtctx->pb);
+
+	if (ret >= 0 && mux->outfile && time_now() >= mux->next_flush) {
+		avio_flush(mux->fmtctx->pb);
+		if (outfile_flush_partial(mux->outfile) < 0)
+			return AVERROR(errno);
+		mux->next_flush = time_now() + FLUSH_INTERVAL;
+	}
+
+	return ret;
+}
+
+void mux_free(struct mux *mux) {
+	if (mux->stream != NULL) {
+		int ret = av_write_trailer(mux->fmtctx);
+		if (ret < 0)
+			logln("Failed to write trailer: %s", av_err2str(ret));
+	}
+
+	avio_flush(mux->fmtctx->pb);
+	if (mux->outfile)
+		outfile_close(mux->outfile);
+
+	av_freep(&mux->fmtctx->pb->buffer);
+	avio_context_free(&mux->fmtctx->pb);
+	avformat_free_context(mux->fmtctx);
+	free(mux);
+}
@@ -0,0 +1,68 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdbool.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "outfile.h"
+
+struct muxconf {
+	const char *path;
+
+	// Container format name (e.g "mp4", "matroska", "mpegts").
+	// If NULL, the format is guessed from the path's extension.
+	const char *format;
+
+	// Write an MP4 with the index at the front instead of fragmenting it.
+	// Requires the recording to be stopped cleanly.
+	bool faststart;
+
+	// Write with O_DIRECT.
+	bool direct;
+
+	// See outfileconf.
+	bool preallocate;
+	double sync_interval;
+};
+
+struct mux {
+	struct outfile *outfile; // NULL for streams
+	AVFormatContext *fmtctx;
+	AVStream *stream;
+	AVRational time_base;
+	bool faststart;
+	bool flush;
+
+	// When to next make what has been muxed to the outfile visible
+	double next_flush;
+};
+
+struct mux *mux_create(struct muxconf *conf);
+
+// Mux to 'write' instead of a file, for streaming. The output isn't seekable,
+// and each packet is flushed to 'write' as soon as it's muxed; MP4 is
+// fragmented at every frame for that.
+struct mux *mux_create_stream(
+		struct muxconf *conf, void *opaque,
+		int (*write)(void *opaque, const uint8_t *buf, int len));
+
+// Whether the encoder needs AV_CODEC_FLAG_GLOBAL_HEADER for this container.
+bool mux_needs_global_header(struct muxconf *conf);
+
+// Add a stream for the opened encoder and write the container header.
+int mux_start(struct mux *mux, AVCodecContext *avctx);
+
+// Same as mux_start, for a stream described by codec parameters.
+int mux_start_params(
+		struct mux *mux, const AVCodecParameters *par,
+		AVRational time_base, AVRational framerate);
+
+// Write a packet with timestamps in the encoder's time base.
+// Takes ownership of the packet's reference.
+int mux_write(struct mux *mux, AVPacket *pkt);
+
+// Write the trailer and close the file.
+void mux_free(struct mux *mux);
+
+#endif
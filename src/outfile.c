@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include "outfile.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "util.h"
+#include "time.h"
+
+#define BLOCK_SIZE (4 * 1024 * 1024)
+#define BLOCK_ALIGN 4096
+#define PREALLOC_EXTENT ((int64_t)256 * 1024 * 1024)
+
+static int write_all(int fd, const unsigned char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return -1;
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// O_DIRECT requires aligned offsets and sizes,
+// so it has to go once we write a partial block.
+static void drop_direct(struct outfile *of) {
+	if (!of->direct)
+		return;
+
+	int flags = fcntl(of->fd, F_GETFL);
+	if (flags < 0 || fcntl(of->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+		logperror("fcntl");
+	of->direct = false;
+}
+
+// Make sure the file is allocated up to 'end', a whole extent at a time.
+// The size stays the same, so readers only see data which has been written.
+static void preallocate(struct outfile *of, int64_t end) {
+	if (!of->preallocate || end <= of->allocated)
+		return;
+
+	int64_t len = (end - of->allocated + PREALLOC_EXTENT - 1) / PREALLOC_EXTENT * PREALLOC_EXTENT;
+	if (fallocate(of->fd, FALLOC_FL_KEEP_SIZE, of->allocated, len) < 0) {
+		logperror("fallocate, not preallocating");
+		of->preallocate = false;
+		return;
+	}
+
+	of->allocated += len;
+}
+
+// Write back what has been written since the last time, and drop it from
+// the page cache. The muxer may seek back and rewrite earlier data,
+// which the kernel writes back eventually, or the final sync does.
+static void *sync_thread(void *arg) {
+	struct outfile *of = arg;
+	int64_t synced = 0;
+
+	pthread_mutex_lock(&of->sync_mut);
+	while (!of->closing) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		int64_t ns = ts.tv_nsec + (int64_t)(of->sync_interval * 1e9);
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&of->sync_cond, &of->sync_mut, &ts);
+		if (of->closing)
+			break;
+		pthread_mutex_unlock(&of->sync_mut);
+
+		int64_t written = atomic_load(&of->written);
+		if (written > synced) {
+			if (sync_file_range(of->fd, synced, written - synced,
+						SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+						SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+				logperror("sync_file_range");
+			posix_fadvise(of->fd, synced, written - synced, POSIX_FADV_DONTNEED);
+			synced = written;
+		}
+
+		pthread_mutex_lock(&of->sync_mut);
+	}
+	pthread_mutex_unlock(&of->sync_mut);
+
+	return NULL;
+}
+
+struct outfile *outfile_open(struct outfileconf *conf) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if (conf->direct)
+		flags |= O_DIRECT;
+
+	int fd = open(conf->path, flags, 0644);
+	if (fd < 0 && conf->direct && errno == EINVAL) {
+		logln("%s: O_DIRECT not supported, falling back to buffered I/O.", conf->path);
+		flags &= ~O_DIRECT;
+		fd = open(conf->path, flags, 0644);
+	}
+
+	if (fd < 0) {
+		logperror("%s", conf->path);
+		return NULL;
+	}
+
+	struct outfile *of = malloc(sizeof(*of));
+	of->fd = fd;
+	of->direct = flags & O_DIRECT;
+	of->buflen = 0;
+	of->off = 0;
+	of->size = 0;
+	of->preallocate = conf->preallocate;
+	of->allocated = 0;
+	of->sync_interval = conf->sync_interval;
+	atomic_init(&of->written, 0);
+	of->closing = false;
+	of->stats = (struct outfile_stats) { 0 };
+
+	if (posix_memalign((void **)&of->buf, BLOCK_ALIGN, BLOCK_SIZE) != 0)
+		panic("Failed to allocate output buffer.");
+
+	preallocate(of, 1);
+
+	if (of->sync_interval > 0) {
+		pthread_mutex_init(&of->sync_mut, NULL);
+		pthread_cond_init(&of->sync_cond, NULL);
+		pthread_create(&of->sync_thread, NULL, sync_thread, of);
+	}
+
+	return of;
+}
+
+int outfile_write(struct outfile *of, const void *data_, size_t len) {
+	const unsigned char *data = data_;
+	while (len > 0) {
+		size_t n = BLOCK_SIZE - of->buflen;
+		if (n > len)
+			n = len;
+
+		memcpy(of->buf + of->buflen, data, n);
+		of->buflen += n;
+		data += n;
+		len -= n;
+
+		if (of->buflen == BLOCK_SIZE && outfile_flush(of) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int64_t outfile_seek(struct outfile *of, int64_t offset, int whence) {
+	if (outfile_flush(of) < 0)
+		return -1;
+
+	// Writes after a seek won't be aligned
+	drop_direct(of);
+
+	off_t ret = lseek(of->fd, offset, whence);
+	if (ret < 0)
+		return -1;
+
+	of->off = ret;
+	return ret;
+}
+
+// Write the first 'len' bytes of the buffer, and keep the rest
+static int write_buffered(struct outfile *of, size_t len) {
+	if (len % BLOCK_ALIGN != 0)
+		drop_direct(of);
+
+	preallocate(of, of->off + len);
+	double start = time_now();
+	if (write_all(of->fd, of->buf, len) < 0)
+		return -1;
+	double t = time_now() - start;
+
+	of->stats.writes += 1;
+	of->stats.time += t;
+	if (t > of->stats.max_time)
+		of->stats.max_time = t;
+
+	of->off += len;
+	if (of->off > of->size) {
+		of->size = of->off;
+		atomic_store(&of->written, of->size);
+	}
+
+	of->buflen -= len;
+	memmove(of->buf, of->buf + len, of->buflen);
+	return 0;
+}
+
+int outfile_flush(struct outfile *of) {
+	if (of->buflen == 0)
+		return 0;
+
+	return write_buffered(of, of->buflen);
+}
+
+int outfile_flush_partial(struct outfile *of) {
+	size_t len = of->buflen;
+	if (of->direct)
+		len -= len % BLOCK_ALIGN;
+	if (len == 0)
+		return 0;
+
+	return write_buffered(of, len);
+}
+
+void outfile_take_stats(struct outfile *of, struct outfile_stats *stats) {
+	*stats = of->stats;
+	of->stats = (struct outfile_stats) { 0 };
+}
+
+int outfile_close(struct outfile *of) {
+	int ret = outfile_flush(of);
+	if (ret < 0)
+		logperror("write");
+
+	if (of->sync_interval > 0) {
+		pthread_mutex_lock(&of->sync_mut);
+		of->closing = true;
+		pthread_cond_signal(&of->sync_cond);
+		pthread_mutex_unlock(&of->sync_mut);
+		pthread_join(of->sync_thread, NULL);
+		pthread_mutex_destroy(&of->sync_mut);
+		pthread_cond_destroy(&of->sync_cond);
+	}
+
+	// Give back the preallocated space past the end
+	if (of->allocated > of->size && ftruncate(of->fd, of->size) < 0) {
+		logperror("ftruncate");
+		ret = -1;
+	}
+
+	if (of->sync_interval > 0) {
+		if (fdatasync(of->fd) < 0) {
+			logperror("fdatasync");
+			ret = -1;
+		}
+		posix_fadvise(of->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	if (close(of->fd) < 0) {
+		logperror("close");
+		ret = -1;
+	}
+
+	free(of->buf);
+	free(of);
+	return ret;
+}
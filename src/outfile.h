@@ -0,0 +1,87 @@
+#ifndef OUTFILE_H
+#define OUTFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Output file which coalesces small writes into large, aligned blocks.
+ *
+ * For long recordings, the file can be preallocated in large extents ahead
+ * of the write position, so that it doesn't fragment, and written data
+ * can be synced and dropped from the page cache on a background thread,
+ * so that the recording doesn't evict everything else.
+ */
+
+struct outfileconf {
+	const char *path;
+
+	// Open the file with O_DIRECT, bypassing the page cache.
+	bool direct;
+
+	// Allocate the file ahead of the write position with fallocate,
+	// and truncate it to the data actually written on close.
+	bool preallocate;
+
+	// Seconds between syncing written data and dropping it from the
+	// page cache, or 0 to leave that to the kernel.
+	double sync_interval;
+};
+
+struct outfile {
+	int fd;
+	bool direct;
+
+	// Block-aligned buffer of data not yet written
+	unsigned char *buf;
+	size_t buflen;
+
+	// File offset of buf[0], and the size of the file
+	int64_t off;
+	int64_t size;
+
+	// How far the file is allocated, when preallocating
+	bool preallocate;
+	int64_t allocated;
+
+	// Background syncing. 'written' is the size, readable without a lock.
+	double sync_interval;
+	_Atomic int64_t written;
+	pthread_t sync_thread;
+	pthread_mutex_t sync_mut;
+	pthread_cond_t sync_cond;
+	bool closing;
+
+	// Time spent in write(2), since the last outfile_take_stats
+	struct outfile_stats {
+		int writes;
+		double time;
+		double max_time;
+	} stats;
+};
+
+struct outfile *outfile_open(struct outfileconf *conf);
+
+int outfile_write(struct outfile *of, const void *data, size_t len);
+
+// Same semantics as lseek. Flushes buffered data first.
+int64_t outfile_seek(struct outfile *of, int64_t offset, int whence);
+
+// Write out all buffered data, even if that means an unaligned write.
+int outfile_flush(struct outfile *of);
+
+// Write out buffered data so that readers of the file can see it.
+// With O_DIRECT, only whole aligned blocks are written, and the rest stays
+// buffered, so that the file can keep using O_DIRECT.
+int outfile_flush_partial(struct outfile *of);
+
+// Get the write stats since the last call, and reset them.
+void outfile_take_stats(struct outfile *of, struct outfile_stats *stats);
+
+// Flushes, truncates any preallocated space, syncs and closes the file.
+int outfile_close(struct outfile *of);
+
+#endif
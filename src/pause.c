@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include "pause.h"
+
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "time.h"
+#include "util.h"
+
+static atomic_int paused;
+
+// Written to on every change, so that the waiter can sleep in poll
+// without a timeout; signal handlers can't signal a condition variable
+static int wakefd[2] = { -1, -1 };
+
+void pause_init() {
+	if (pipe2(wakefd, O_CLOEXEC | O_NONBLOCK) < 0)
+		ppanic("pipe");
+}
+
+void pause_wake() {
+	// If the pipe is full, the waiter has a wakeup coming anyway
+	int saved = errno;
+	ssize_t ret = write(wakefd[1], "", 1);
+	(void)ret;
+	errno = saved;
+}
+
+void pause_set(bool p) {
+	atomic_store(&paused, p);
+	pause_wake();
+}
+
+void pause_toggle() {
+	atomic_fetch_xor(&paused, 1);
+	pause_wake();
+}
+
+bool pause_is_paused() {
+	return atomic_load(&paused);
+}
+
+double pause_wait(volatile sig_atomic_t *stop) {
+	if (!atomic_load(&paused))
+		return 0;
+
+	logln("Paused.");
+	double start = time_now();
+	while (atomic_load(&paused) && !*stop) {
+		struct pollfd pfd = { .fd = wakefd[0], .events = POLLIN };
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			ppanic("poll");
+
+		char buf[64];
+		while (read(wakefd[0], buf, sizeof(buf)) > 0);
+	}
+
+	double t = time_now() - start;
+	if (!*stop)
+		logln("Resumed after %.1fs.", t);
+	return t;
+}
@@ -0,0 +1,29 @@
+#ifndef PAUSE_H
+#define PAUSE_H
+
+#include <stdbool.h>
+#include <signal.h>
+
+/*
+ * Pausing and resuming the recording, from signal handlers or the stats socket.
+ * While paused, the capturer sleeps in pause_wait, and every later stage
+ * sleeps on its empty input queue, so a paused recorder uses no CPU.
+ * The X connection, shm segments, OpenCL and the encoders all stay set up.
+ */
+
+void pause_init();
+
+// Request pausing or resuming. Safe to call from signal handlers.
+void pause_set(bool paused);
+void pause_toggle();
+
+// Wake up pause_wait, e.g to stop while paused. Safe to call from signal handlers.
+void pause_wake();
+
+bool pause_is_paused();
+
+// If paused, sleep until resumed or '*stop' is set.
+// Only one thread may wait. Returns the number of seconds spent paused.
+double pause_wait(volatile sig_atomic_t *stop);
+
+#endif
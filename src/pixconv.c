@@ -1,6 +1,7 @@
 #include "pixconv.h"
 
 #include <stdbool.h>
+#include <pthread.h>
 
 // 2.0 support seems to be limited (fuck nvidia):
 // https://en.wikipedia.org/wiki/OpenCL#OpenCL_2.0_support
@@ -11,6 +12,8 @@
 
 #include "assets.h"
 #include "clerr.h"
+#include "time.h"
+#include "timeline.h"
 #include "util.h"
 
 #define CHECKERR(err) do { \
@@ -25,23 +28,35 @@ struct pixconv_cl {
 	cl_context context;
 	cl_command_queue queue;
 	cl_device_id device;
+
+	// Siblings share their parent's queue and input image
+	struct pixconv_cl *parent;
+	cl_mem input_image;
+
+	// With the timeline on, the queue has profiling enabled and commands
+	// get events, which are turned into timeline spans after every conversion.
+	// There's one write per frame in the batch, and a read per plane per frame.
+	bool profiling;
+	cl_event *write_events;
+	cl_event kernel_event;
+	cl_event *read_events;
+	int nread_events;
+	uint64_t write_queued; // Host time
 };
 
+#define MAX_PLANES 3
+
 struct pixconv_rgb32_nv12 {
 	struct pixconv_cl cl;
-	cl_mem input_image;
 	cl_mem output_y_image;
 	cl_mem output_uv_image;
-	cl_event events[2];
 };
 
 struct pixconv_rgb32_yuv420 {
 	struct pixconv_cl cl;
-	cl_mem input_image;
 	cl_mem output_y_image;
 	cl_mem output_u_image;
 	cl_mem output_v_image;
-	cl_event events[3];
 };
 
 static bool is_rgb32_nv12(enum AVPixelFormat in, enum AVPixelFormat out) {
@@ -60,7 +75,25 @@ static void rgbdesc(enum AVPixelFormat fmt, int *r, int *g, int *b) {
 	}
 }
 
-static int setup_cl(struct pixconv_cl *cl, const char *kname) {
+// The CL device and context are shared between all pixconv instances,
+// and programs are cached per kernel configuration.
+struct cl_program_cache {
+	struct cl_program_cache *next;
+	char *options;
+	cl_program program;
+};
+
+static struct {
+	pthread_mutex_t mut;
+	bool initialized;
+	cl_device_id device;
+	cl_context context;
+	struct cl_program_cache *programs;
+} clenv = {
+	.mut = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void setup_clenv() {
 	int err;
 
 	cl_platform_id platform_ids[10];
@@ -105,7 +138,7 @@ static int setup_cl(struct pixconv_cl *cl, const char *kname) {
 
 			if (image_support) {
 				logln("  Device %i: %s", j, devname);
-				cl->device = device_ids[j];
+				clenv.device = device_ids[j];
 			} else {
 				logln("  Device %i: %s - No image support, ignoring.", j, devname);
 			}
@@ -114,55 +147,173 @@ static int setup_cl(struct pixconv_cl *cl, const char *kname) {
 
 	char devname[128];
 	err = clGetDeviceInfo(
-			cl->device, CL_DEVICE_NAME,
+			clenv.device, CL_DEVICE_NAME,
 			sizeof(devname), devname, NULL);
 	CHECKERR(err);
 	logln("Using %s.", devname);
 
-	cl->context = clCreateContext(0, 1, &cl->device, NULL, NULL, &err);
+	clenv.context = clCreateContext(0, 1, &clenv.device, NULL, NULL, &err);
 	CHECKERR(err);
 
-	cl->queue = clCreateCommandQueue(cl->context, cl->device, 0, &err);
-	CHECKERR(err);
+	clenv.initialized = true;
+}
+
+void pixconv_init() {
+	pthread_mutex_lock(&clenv.mut);
+	if (!clenv.initialized)
+		setup_clenv();
+	pthread_mutex_unlock(&clenv.mut);
+}
 
-	cl->program = clCreateProgramWithSource(
-			cl->context, 1,
+// Must be called with clenv.mut held
+static cl_program get_program(const char *options) {
+	int err;
+
+	for (struct cl_program_cache *pc = clenv.programs; pc; pc = pc->next) {
+		if (strcmp(pc->options, options) == 0)
+			return pc->program;
+	}
+
+	logln("Building kernels with options: %s", options);
+	cl_program program = clCreateProgramWithSource(
+			clenv.context, 1,
 			(const char *[]) { (char *)ASSETS_CONVERT_IMAGE_CL },
 			(size_t[]) { ASSETS_CONVERT_IMAGE_CL_LEN },
 			&err);
 	CHECKERR(err);
 
-	err = clBuildProgram(cl->program, 0, NULL, NULL, NULL, NULL);
+	err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
 	if (err) {
 		size_t len;
 		err = clGetProgramBuildInfo(
-				cl->program, cl->device, CL_PROGRAM_BUILD_LOG,
+				program, clenv.device, CL_PROGRAM_BUILD_LOG,
 				0, NULL, &len);
 		CHECKERR(err);
 
 		char *logstr = malloc(len);
 		err = clGetProgramBuildInfo(
-				cl->program, cl->device, CL_PROGRAM_BUILD_LOG,
+				program, clenv.device, CL_PROGRAM_BUILD_LOG,
 				len, logstr, &len);
 		CHECKERR(err);
 
 		fprintf(stderr, "Failed to compile:\n%s", logstr);
 		free(logstr);
-		return -1;
+		clReleaseProgram(program);
+		return NULL;
 	}
 
+	struct cl_program_cache *pc = malloc(sizeof(*pc));
+	pc->options = strdup(options);
+	pc->program = program;
+	pc->next = clenv.programs;
+	clenv.programs = pc;
+	return program;
+}
+
+// Bake channel positions and scale factors into the kernel as constants,
+// so that the compiler can fold them and pick a fast path for 1:1 and 2:1.
+// Batched conversions use the kernels' image array variants.
+static void build_options(
+		char *buf, size_t size,
+		struct rect inrect, enum AVPixelFormat infmt, struct rect outrect, int batch) {
+	int r, g, b;
+	rgbdesc(infmt, &r, &g, &b);
+
+	const char *scale = "";
+	if (inrect.w == outrect.w && inrect.h == outrect.h)
+		scale = " -DSCALE_IDENTITY";
+	else if (inrect.w == outrect.w * 2 && inrect.h == outrect.h * 2)
+		scale = " -DSCALE_HALF";
+
+	// Hex float literals represent the scale factors exactly
+	snprintf(buf, size,
+			"-DIN_R=s%i -DIN_G=s%i -DIN_B=s%i -DSCALE_X=%af -DSCALE_Y=%af%s%s",
+			r, g, b,
+			(double)((float)inrect.w / (float)outrect.w),
+			(double)((float)inrect.h / (float)outrect.h),
+			scale, batch > 1 ? " -DBATCH" : "");
+}
+
+// Images hold one frame, or an array of one frame per batch slot
+static cl_image_desc image_desc(struct pixconv_cl *cl, int width, int height) {
+	return (cl_image_desc) {
+		.image_type = cl->conv.batch > 1 ? CL_MEM_OBJECT_IMAGE2D_ARRAY : CL_MEM_OBJECT_IMAGE2D,
+		.image_width = width,
+		.image_height = height,
+		.image_array_size = cl->conv.batch,
+	};
+}
+
+static int setup_cl(
+		struct pixconv_cl *cl, struct pixconv_cl *parent,
+		const char *kname, const char *options, struct rect inrect, int batch) {
+	int err;
+
+	pthread_mutex_lock(&clenv.mut);
+	if (!clenv.initialized)
+		setup_clenv();
+
+	cl->device = clenv.device;
+	cl->context = clenv.context;
+	cl->program = get_program(options);
+	pthread_mutex_unlock(&clenv.mut);
+
+	if (cl->program == NULL)
+		return -1;
+
 	cl->kernel = clCreateKernel(cl->program, kname, &err);
 	CHECKERR(err);
 
+	cl->parent = parent;
+	cl->conv.batch = batch;
+	cl->write_events = NULL;
+	cl->read_events = NULL;
+	if (parent) {
+		cl->queue = parent->queue;
+		cl->input_image = parent->input_image;
+		cl->profiling = parent->profiling;
+	} else {
+		cl->profiling = timeline_enabled();
+		cl->queue = clCreateCommandQueue(
+				cl->context, cl->device,
+				cl->profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+		CHECKERR(err);
+
+		// Set up input image
+		cl_image_format input_format = {
+			.image_channel_data_type = CL_UNSIGNED_INT8,
+			.image_channel_order = CL_RGBA,
+		};
+		cl_image_desc input_desc = image_desc(cl, inrect.w, inrect.h);
+		cl->input_image = clCreateImage(
+				cl->context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY,
+				&input_format, &input_desc, NULL, &err);
+		CHECKERR(err);
+	}
+
+	err = clSetKernelArg(cl->kernel, 0, sizeof(cl->input_image), &cl->input_image);
+	CHECKERR(err);
+
+	if (cl->profiling) {
+		if (!parent)
+			cl->write_events = malloc(sizeof(*cl->write_events) * batch);
+		cl->read_events = malloc(sizeof(*cl->read_events) * batch * MAX_PLANES);
+	}
+
 	return 0;
 }
 
-struct pixconv *pixconv_create(
+static struct pixconv *create(
+		struct pixconv_cl *parent,
 		struct rect inrect, enum AVPixelFormat infmt,
-		struct rect outrect, enum AVPixelFormat outfmt) {
+		struct rect outrect, enum AVPixelFormat outfmt, int batch) {
 	assume(
 			is_rgb32_nv12(infmt, outfmt) ||
 			is_rgb32_yuv420(infmt, outfmt));
+	assume(batch >= 1);
+
+	char options[256];
+	build_options(options, sizeof(options), inrect, infmt, outrect, batch);
 
 	struct pixconv_cl *cl;
 	int err;
@@ -170,7 +321,7 @@ struct pixconv *pixconv_create(
 		struct pixconv_rgb32_nv12 *rgb32_nv12 = malloc(sizeof(*rgb32_nv12));
 		cl = (struct pixconv_cl *)rgb32_nv12;
 
-		int ret = setup_cl(cl, "convert_rgb32_nv12");
+		int ret = setup_cl(cl, parent, "convert_rgb32_nv12", options, inrect, batch);
 
 		if (ret < 0) {
 			logln("Creating kernel failed.");
@@ -178,56 +329,17 @@ struct pixconv *pixconv_create(
 			return NULL;
 		}
 
-		float scale_x = (float)inrect.w / (float)outrect.w;
-		err = clSetKernelArg(cl->kernel, 0, sizeof(scale_x), &scale_x);
-		CHECKERR(err);
-		float scale_y = (float)inrect.h / (float)outrect.h;
-		err = clSetKernelArg(cl->kernel, 1, sizeof(scale_y), &scale_y);
-		CHECKERR(err);
-
-		// Set up RGB positions
-		int r, g, b;
-		rgbdesc(infmt, &r, &g, &b);
-		err = clSetKernelArg(cl->kernel, 2, sizeof(r), &r);
-		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 3, sizeof(g), &g);
-		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 4, sizeof(b), &b);
-		CHECKERR(err);
-
-		// Set up input image
-		cl_image_format input_format = {
-			.image_channel_data_type = CL_UNSIGNED_INT8,
-			.image_channel_order = CL_RGBA,
-		};
-		cl_image_desc input_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = inrect.w,
-			.image_height = inrect.h,
-		};
-		rgb32_nv12->input_image = clCreateImage(
-				cl->context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY,
-				&input_format, &input_desc, NULL, &err);
-		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 5,
-				sizeof(rgb32_nv12->input_image), &rgb32_nv12->input_image);
-		CHECKERR(err);
-
 		// Set up output Y image
 		cl_image_format output_y_format = {
 			.image_channel_data_type = CL_UNSIGNED_INT8,
 			.image_channel_order = CL_R,
 		};
-		cl_image_desc output_y_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = outrect.w,
-			.image_height = outrect.h,
-		};
+		cl_image_desc output_y_desc = image_desc(cl, outrect.w, outrect.h);
 		rgb32_nv12->output_y_image = clCreateImage(
 				cl->context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
 				&output_y_format, &output_y_desc, NULL, &err);
 		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 6,
+		err = clSetKernelArg(cl->kernel, 1,
 				sizeof(rgb32_nv12->output_y_image), &rgb32_nv12->output_y_image);
 		CHECKERR(err);
 
@@ -236,30 +348,20 @@ struct pixconv *pixconv_create(
 			.image_channel_data_type = CL_UNSIGNED_INT8,
 			.image_channel_order = CL_RG,
 		};
-		cl_image_desc output_uv_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = outrect.w / 2,
-			.image_height = outrect.h / 2,
-		};
+		cl_image_desc output_uv_desc = image_desc(cl, outrect.w / 2, outrect.h / 2);
 		rgb32_nv12->output_uv_image = clCreateImage(
 				cl->context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
 				&output_uv_format, &output_uv_desc, NULL, &err);
 		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 7,
+		err = clSetKernelArg(cl->kernel, 2,
 				sizeof(rgb32_nv12->output_uv_image), &rgb32_nv12->output_uv_image);
 		CHECKERR(err);
 
-		// Set up events
-		for (int i = 0; i < 2; ++i) {
-			rgb32_nv12->events[i] = clCreateUserEvent(cl->context, &err);
-			CHECKERR(err);
-		}
-
 	} else if (is_rgb32_yuv420(infmt, outfmt)) {
 		struct pixconv_rgb32_yuv420 *rgb32_yuv420 = malloc(sizeof(*rgb32_yuv420));
 		cl = (struct pixconv_cl *)rgb32_yuv420;
 
-		int ret = setup_cl(cl, "convert_rgb32_yuv420");
+		int ret = setup_cl(cl, parent, "convert_rgb32_yuv420", options, inrect, batch);
 
 		if (ret < 0) {
 			logln("Creating kernel failed.");
@@ -267,56 +369,17 @@ struct pixconv *pixconv_create(
 			return NULL;
 		}
 
-		float scale_x = (float)inrect.w / (float)outrect.w;
-		err = clSetKernelArg(cl->kernel, 0, sizeof(scale_x), &scale_x);
-		CHECKERR(err);
-		float scale_y = (float)inrect.h / (float)outrect.h;
-		err = clSetKernelArg(cl->kernel, 1, sizeof(scale_y), &scale_y);
-		CHECKERR(err);
-
-		// Set up RGB positions
-		int r, g, b;
-		rgbdesc(infmt, &r, &g, &b);
-		err = clSetKernelArg(cl->kernel, 2, sizeof(r), &r);
-		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 3, sizeof(g), &g);
-		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 4, sizeof(b), &b);
-		CHECKERR(err);
-
-		// Set up input image
-		cl_image_format input_format = {
-			.image_channel_data_type = CL_UNSIGNED_INT8,
-			.image_channel_order = CL_RGBA,
-		};
-		cl_image_desc input_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = inrect.w,
-			.image_height = inrect.h,
-		};
-		rgb32_yuv420->input_image = clCreateImage(
-				cl->context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY,
-				&input_format, &input_desc, NULL, &err);
-		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 5,
-				sizeof(rgb32_yuv420->input_image), &rgb32_yuv420->input_image);
-		CHECKERR(err);
-
 		// Set up output Y image
 		cl_image_format output_y_format = {
 			.image_channel_data_type = CL_UNSIGNED_INT8,
 			.image_channel_order = CL_R,
 		};
-		cl_image_desc output_y_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = outrect.w,
-			.image_height = outrect.h,
-		};
+		cl_image_desc output_y_desc = image_desc(cl, outrect.w, outrect.h);
 		rgb32_yuv420->output_y_image = clCreateImage(
 				cl->context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
 				&output_y_format, &output_y_desc, NULL, &err);
 		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 6,
+		err = clSetKernelArg(cl->kernel, 1,
 				sizeof(rgb32_yuv420->output_y_image), &rgb32_yuv420->output_y_image);
 		CHECKERR(err);
 
@@ -325,16 +388,12 @@ struct pixconv *pixconv_create(
 			.image_channel_data_type = CL_UNSIGNED_INT8,
 			.image_channel_order = CL_R,
 		};
-		cl_image_desc output_u_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = outrect.w / 2,
-			.image_height = outrect.h / 2,
-		};
+		cl_image_desc output_u_desc = image_desc(cl, outrect.w / 2, outrect.h / 2);
 		rgb32_yuv420->output_u_image = clCreateImage(
 				cl->context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
 				&output_u_format, &output_u_desc, NULL, &err);
 		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 7,
+		err = clSetKernelArg(cl->kernel, 2,
 				sizeof(rgb32_yuv420->output_u_image), &rgb32_yuv420->output_u_image);
 		CHECKERR(err);
 
@@ -343,25 +402,15 @@ struct pixconv *pixconv_create(
 			.image_channel_data_type = CL_UNSIGNED_INT8,
 			.image_channel_order = CL_R,
 		};
-		cl_image_desc output_v_desc = {
-			.image_type = CL_MEM_OBJECT_IMAGE2D,
-			.image_width = outrect.w / 2,
-			.image_height = outrect.h / 2,
-		};
+		cl_image_desc output_v_desc = image_desc(cl, outrect.w / 2, outrect.h / 2);
 		rgb32_yuv420->output_v_image = clCreateImage(
 				cl->context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
 				&output_v_format, &output_v_desc, NULL, &err);
 		CHECKERR(err);
-		err = clSetKernelArg(cl->kernel, 8,
+		err = clSetKernelArg(cl->kernel, 3,
 				sizeof(rgb32_yuv420->output_v_image), &rgb32_yuv420->output_v_image);
 		CHECKERR(err);
 
-		// Set up events
-		for (int i = 0; i < 3; ++i) {
-			rgb32_yuv420->events[i] = clCreateUserEvent(cl->context, &err);
-			CHECKERR(err);
-		}
-
 	} else {
 		assume_unreached();
 	}
@@ -374,112 +423,205 @@ struct pixconv *pixconv_create(
 	return (struct pixconv *)cl;
 }
 
-void pixconv_free(struct pixconv *conv) {
-	free(conv);
+struct pixconv *pixconv_create(
+		struct rect inrect, enum AVPixelFormat infmt,
+		struct rect outrect, enum AVPixelFormat outfmt) {
+	return create(NULL, inrect, infmt, outrect, outfmt, 1);
 }
 
-int pixconv_convert(
-		struct pixconv *conv,
-		uint8_t **inplanes, const int *instrides,
-		uint8_t **outplanes, const int *outstrides) {
-	int err;
+struct pixconv *pixconv_create_batched(
+		struct rect inrect, enum AVPixelFormat infmt,
+		struct rect outrect, enum AVPixelFormat outfmt, int batch) {
+	return create(NULL, inrect, infmt, outrect, outfmt, batch);
+}
 
+struct pixconv *pixconv_create_sibling(
+		struct pixconv *parent,
+		struct rect outrect, enum AVPixelFormat outfmt) {
+	return create(
+			(struct pixconv_cl *)parent,
+			parent->inrect, parent->infmt, outrect, outfmt, parent->batch);
+}
+
+void pixconv_free(struct pixconv *conv) {
 	struct pixconv_cl *cl = (struct pixconv_cl *)conv;
 
+	// Profiling events are released after every conversion,
+	// and programs stay cached for the next pixconv
 	if (is_rgb32_nv12(conv->infmt, conv->outfmt)) {
 		struct pixconv_rgb32_nv12 *rgb32_nv12 = (struct pixconv_rgb32_nv12 *)cl;
+		clReleaseMemObject(rgb32_nv12->output_y_image);
+		clReleaseMemObject(rgb32_nv12->output_uv_image);
+	} else if (is_rgb32_yuv420(conv->infmt, conv->outfmt)) {
+		struct pixconv_rgb32_yuv420 *rgb32_yuv420 = (struct pixconv_rgb32_yuv420 *)cl;
+		clReleaseMemObject(rgb32_yuv420->output_y_image);
+		clReleaseMemObject(rgb32_yuv420->output_u_image);
+		clReleaseMemObject(rgb32_yuv420->output_v_image);
+	}
+	clReleaseKernel(cl->kernel);
 
-		// Write input
-		err = clEnqueueWriteImage (
-				cl->queue, rgb32_nv12->input_image, CL_TRUE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->inrect.w, conv->inrect.h, 1 },
-				instrides[0], 0, inplanes[0],
-				0, NULL, NULL);
-		CHECKERR(err);
+	// Siblings use their parent's queue and input image
+	if (!cl->parent) {
+		clReleaseMemObject(cl->input_image);
+		clReleaseCommandQueue(cl->queue);
+	}
 
-		// Run kernel
-		err = clEnqueueNDRangeKernel(
-				cl->queue, cl->kernel, 2, NULL,
-				(const size_t[]) { conv->outrect.w, conv->outrect.h, 0 }, NULL,
-				0, NULL, NULL);
-		CHECKERR(err);
+	free(cl->write_events);
+	free(cl->read_events);
+	free(conv);
+}
 
-		// Read Y
-		err = clEnqueueReadImage(
-				cl->queue, rgb32_nv12->output_y_image, CL_FALSE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->outrect.w, conv->outrect.h, 1 },
-				outstrides[0], 0, outplanes[0],
-				0, NULL, &rgb32_nv12->events[0]);
-		CHECKERR(err);
+// Upload one frame into its slot of the input image. The write doesn't
+// block; the caller waits for the whole batch at once.
+static void upload(struct pixconv_cl *cl, int slot, const struct pixconv_image *in) {
+	if (slot == 0)
+		cl->write_queued = time_now_ns();
+
+	int err = clEnqueueWriteImage(
+			cl->queue, cl->input_image, CL_FALSE,
+			(const size_t[]) { 0, 0, slot },
+			(const size_t[]) { cl->conv.inrect.w, cl->conv.inrect.h, 1 },
+			in->strides[0], 0, in->planes[0],
+			0, NULL, cl->profiling ? &cl->write_events[slot] : NULL);
+	CHECKERR(err);
+}
 
-		// Read UV
-		err = clEnqueueReadImage(
-				cl->queue, rgb32_nv12->output_uv_image, CL_FALSE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->outrect.w / 2, conv->outrect.h / 2, 1 },
-				outstrides[1], 0, outplanes[1],
-				0, NULL, &rgb32_nv12->events[1]);
-		CHECKERR(err);
+static void read_plane(
+		struct pixconv_cl *cl, cl_mem image, int width, int height,
+		int slot, int stride, uint8_t *plane) {
+	cl_event *event = NULL;
+	if (cl->profiling)
+		event = &cl->read_events[cl->nread_events++];
+
+	int err = clEnqueueReadImage(
+			cl->queue, image, CL_FALSE,
+			(const size_t[]) { 0, 0, slot },
+			(const size_t[]) { width, height, 1 },
+			stride, 0, plane,
+			0, NULL, event);
+	CHECKERR(err);
+}
 
-		// Wait for reads to complete
-		err = clWaitForEvents(2, rgb32_nv12->events);
-		CHECKERR(err);
+// Enqueue the kernel for 'k' frames and the reads of its output.
+// The output for frame j is out[j * stride].
+static void enqueue(
+		struct pixconv *conv, int k,
+		const struct pixconv_image *out, int stride) {
+	int err;
 
-		return 0;
-	} else if (is_rgb32_yuv420(conv->infmt, conv->outfmt)) {
-		struct pixconv_rgb32_yuv420 *rgb32_yuv420 = (struct pixconv_rgb32_yuv420 *)cl;
+	struct pixconv_cl *cl = (struct pixconv_cl *)conv;
+	cl->nread_events = 0;
 
-		// Write input
-		err = clEnqueueWriteImage (
-				cl->queue, rgb32_yuv420->input_image, CL_TRUE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->inrect.w, conv->inrect.h, 1 },
-				instrides[0], 0, inplanes[0],
-				0, NULL, NULL);
-		CHECKERR(err);
+	// Run kernel, with one frame per layer of the batch
+	err = clEnqueueNDRangeKernel(
+			cl->queue, cl->kernel, 3, NULL,
+			(const size_t[]) { conv->outrect.w, conv->outrect.h, k }, NULL,
+			0, NULL, cl->profiling ? &cl->kernel_event : NULL);
+	CHECKERR(err);
 
-		// Run kernel
-		CHECKERR(err);
-		err = clEnqueueNDRangeKernel(
-				cl->queue, cl->kernel, 2, NULL,
-				(const size_t[]) { conv->outrect.w, conv->outrect.h, 0 }, NULL,
-				0, NULL, NULL);
-		CHECKERR(err);
+	int w = conv->outrect.w;
+	int h = conv->outrect.h;
+	for (int j = 0; j < k; ++j) {
+		const struct pixconv_image *o = &out[j * stride];
+		if (is_rgb32_nv12(conv->infmt, conv->outfmt)) {
+			struct pixconv_rgb32_nv12 *rgb32_nv12 = (struct pixconv_rgb32_nv12 *)cl;
+			read_plane(cl, rgb32_nv12->output_y_image, w, h, j, o->strides[0], o->planes[0]);
+			read_plane(cl, rgb32_nv12->output_uv_image, w / 2, h / 2, j, o->strides[1], o->planes[1]);
+		} else if (is_rgb32_yuv420(conv->infmt, conv->outfmt)) {
+			struct pixconv_rgb32_yuv420 *rgb32_yuv420 = (struct pixconv_rgb32_yuv420 *)cl;
+			read_plane(cl, rgb32_yuv420->output_y_image, w, h, j, o->strides[0], o->planes[0]);
+			read_plane(cl, rgb32_yuv420->output_u_image, w / 2, h / 2, j, o->strides[1], o->planes[1]);
+			read_plane(cl, rgb32_yuv420->output_v_image, w / 2, h / 2, j, o->strides[2], o->planes[2]);
+		} else {
+			assume_unreached();
+		}
+	}
+}
 
-		// Read Y
-		err = clEnqueueReadImage(
-				cl->queue, rgb32_yuv420->output_y_image, CL_FALSE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->outrect.w, conv->outrect.h, 1 },
-				outstrides[0], 0, outplanes[0],
-				0, NULL, &rgb32_yuv420->events[0]);
-		CHECKERR(err);
+int pixconv_convert(
+		struct pixconv *conv,
+		uint8_t **inplanes, const int *instrides,
+		uint8_t **outplanes, const int *outstrides) {
+	return pixconv_convert_many(
+			&conv, 1, inplanes, instrides, &outplanes, &outstrides);
+}
 
-		// Read U
-		err = clEnqueueReadImage(
-				cl->queue, rgb32_yuv420->output_u_image, CL_FALSE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->outrect.w / 2, conv->outrect.h / 2, 1 },
-				outstrides[1], 0, outplanes[1],
-				0, NULL, &rgb32_yuv420->events[1]);
-		CHECKERR(err);
+int pixconv_convert_many(
+		struct pixconv **convs, int n,
+		uint8_t **inplanes, const int *instrides,
+		uint8_t ***outplanes, const int **outstrides) {
+	struct pixconv_image in = { inplanes, instrides };
+	struct pixconv_image out[n];
+	for (int i = 0; i < n; ++i) {
+		out[i].planes = outplanes[i];
+		out[i].strides = outstrides[i];
+	}
 
-		// Read V
-		err = clEnqueueReadImage(
-				cl->queue, rgb32_yuv420->output_v_image, CL_FALSE,
-				(const size_t[]) { 0, 0, 0 },
-				(const size_t[]) { conv->outrect.w / 2, conv->outrect.h / 2, 1 },
-				outstrides[2], 0, outplanes[2],
-				0, NULL, &rgb32_yuv420->events[2]);
-		CHECKERR(err);
+	return pixconv_convert_batch(convs, n, 1, &in, out);
+}
 
-		err = clWaitForEvents(3, rgb32_yuv420->events);
-		CHECKERR(err);
+static uint64_t event_time(cl_event event, cl_profiling_info param) {
+	cl_ulong t;
+	int err = clGetEventProfilingInfo(event, param, sizeof(t), &t, NULL);
+	CHECKERR(err);
+	return t;
+}
 
-		return 0;
-	} else {
-		assume_unreached();
+// Add the device-side upload, kernel and readback times to the timeline.
+// Device time is mapped to host time by taking the first upload's device-side
+// queue time to be the host time when it was enqueued.
+static void emit_profile(struct pixconv **convs, int n, int k) {
+	struct pixconv_cl *parent = (struct pixconv_cl *)convs[0];
+	int64_t offset = (int64_t)parent->write_queued -
+		(int64_t)event_time(parent->write_events[0], CL_PROFILING_COMMAND_QUEUED);
+
+#define HOST(event, param) ((uint64_t)((int64_t)event_time(event, param) + offset))
+
+	// The commands run back to back on the in-order queue
+	timeline_span("conv.write",
+			HOST(parent->write_events[0], CL_PROFILING_COMMAND_START),
+			HOST(parent->write_events[k - 1], CL_PROFILING_COMMAND_END));
+	for (int j = 0; j < k; ++j)
+		clReleaseEvent(parent->write_events[j]);
+
+	for (int i = 0; i < n; ++i) {
+		struct pixconv_cl *cl = (struct pixconv_cl *)convs[i];
+		timeline_span("conv.kernel",
+				HOST(cl->kernel_event, CL_PROFILING_COMMAND_START),
+				HOST(cl->kernel_event, CL_PROFILING_COMMAND_END));
+		clReleaseEvent(cl->kernel_event);
+
+		timeline_span("conv.read",
+				HOST(cl->read_events[0], CL_PROFILING_COMMAND_START),
+				HOST(cl->read_events[cl->nread_events - 1], CL_PROFILING_COMMAND_END));
+		for (int j = 0; j < cl->nread_events; ++j)
+			clReleaseEvent(cl->read_events[j]);
 	}
+
+#undef HOST
+}
+
+int pixconv_convert_batch(
+		struct pixconv **convs, int n, int k,
+		const struct pixconv_image *in, const struct pixconv_image *out) {
+	struct pixconv_cl *parent = (struct pixconv_cl *)convs[0];
+	assume(k >= 1 && k <= parent->conv.batch);
+
+	for (int j = 0; j < k; ++j)
+		upload(parent, j, &in[j]);
+
+	// Everything runs on the same in-order queue,
+	// so all kernels can be enqueued before waiting for any reads
+	for (int i = 0; i < n; ++i) {
+		assume(((struct pixconv_cl *)convs[i])->queue == parent->queue);
+		enqueue(convs[i], k, &out[i], n);
+	}
+
+	int err = clFinish(parent->queue);
+	CHECKERR(err);
+
+	if (parent->profiling)
+		emit_profile(convs, n, k);
+
+	return 0;
 }
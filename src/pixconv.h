@@ -10,12 +10,39 @@ struct pixconv {
 	enum AVPixelFormat infmt;
 	struct rect outrect;
 	enum AVPixelFormat outfmt;
+
+	// Maximum number of frames per pixconv_convert_batch
+	int batch;
+};
+
+// Planes of one image, for batched conversion
+struct pixconv_image {
+	uint8_t **planes;
+	const int *strides;
 };
 
+// Set up the OpenCL device and context, which pixconv_create otherwise
+// does on first use. Call it from another thread to get that out of the way.
+void pixconv_init();
+
 struct pixconv *pixconv_create(
 		struct rect inrect, enum AVPixelFormat infmt,
 		struct rect outrect, enum AVPixelFormat outfmt);
 
+// Create a conversion which can convert up to 'batch' frames at once,
+// with one kernel launch over image arrays.
+struct pixconv *pixconv_create_batched(
+		struct rect inrect, enum AVPixelFormat infmt,
+		struct rect outrect, enum AVPixelFormat outfmt, int batch);
+
+// Create a conversion from the same input as 'parent', to another output.
+// Siblings share the parent's input image, so the input is only uploaded once
+// when they're converted together with pixconv_convert_many.
+struct pixconv *pixconv_create_sibling(
+		struct pixconv *parent,
+		struct rect outrect, enum AVPixelFormat outfmt);
+
+// Free a pixconv and its OpenCL objects. Siblings must be freed before their parent.
 void pixconv_free(struct pixconv *conv);
 
 int pixconv_convert(
@@ -23,4 +50,17 @@ int pixconv_convert(
 		uint8_t **inplanes, const int *instrides,
 		uint8_t **outplanes, const int *outstrides);
 
+// Convert one input to the outputs of a pixconv and its siblings.
+int pixconv_convert_many(
+		struct pixconv **convs, int n,
+		uint8_t **inplanes, const int *instrides,
+		uint8_t ***outplanes, const int **outstrides);
+
+// Convert 'k' inputs, up to the batch size, to the outputs of a pixconv and
+// its siblings, waiting once for all of them. The output of conversion i
+// for input j goes to out[j * n + i].
+int pixconv_convert_batch(
+		struct pixconv **convs, int n, int k,
+		const struct pixconv_image *in, const struct pixconv_image *out);
+
 #endif
@@ -0,0 +1,172 @@
+#include "probecache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <libavcodec/avcodec.h>
+
+#include "util.h"
+
+static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t probecache_hash(uint64_t h, const char *str) {
+	for (const char *c = str; *c; ++c) {
+		h ^= (unsigned char)*c;
+		h *= 0x100000001b3ull;
+	}
+
+	// Separate the fields, so that "ab"+"c" and "a"+"bc" differ
+	h ^= 0xff;
+	h *= 0x100000001b3ull;
+	return h;
+}
+
+static uint64_t hash_file(uint64_t h, const char *path) {
+	char buf[256] = "";
+	FILE *f = fopen(path, "r");
+	if (f) {
+		size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+		buf[n] = '\0';
+		fclose(f);
+	}
+
+	return probecache_hash(h, buf);
+}
+
+// Whatever decides whether a hardware encoder works
+static uint64_t fingerprint() {
+	uint64_t h = PROBECACHE_HASH_INIT;
+
+	struct utsname uts;
+	if (uname(&uts) == 0) {
+		h = probecache_hash(h, uts.nodename);
+		h = probecache_hash(h, uts.release);
+	}
+
+	h = hash_file(h, "/proc/driver/nvidia/version");
+
+	// Render nodes come and go with the GPUs and their drivers
+	DIR *dir = opendir("/dev/dri");
+	if (dir) {
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL)
+			h ^= probecache_hash(PROBECACHE_HASH_INIT, ent->d_name);
+		closedir(dir);
+	}
+
+	char version[16];
+	snprintf(version, sizeof(version), "%u", avcodec_version());
+	return probecache_hash(h, version);
+}
+
+static char *cache_path() {
+	if (getenv("XRECORD_NO_PROBE_CACHE"))
+		return NULL;
+
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *suffix = "";
+	if (base == NULL || base[0] == '\0') {
+		base = getenv("HOME");
+		suffix = "/.cache";
+		if (base == NULL)
+			return NULL;
+	}
+
+	size_t len = strlen(base) + strlen(suffix) + sizeof("/xrecord/probe");
+	char *path = malloc(len);
+	snprintf(path, len, "%s%s/xrecord/probe", base, suffix);
+	return path;
+}
+
+char *probecache_get(const char *key) {
+	char *path = cache_path();
+	if (path == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&mut);
+	FILE *f = fopen(path, "r");
+	free(path);
+
+	char *value = NULL;
+	if (f) {
+		char fp[17];
+		snprintf(fp, sizeof(fp), "%016llx", (unsigned long long)fingerprint());
+
+		char line[256];
+		while (value == NULL && fgets(line, sizeof(line), f)) {
+			char lfp[17], lkey[64], lval[64];
+			if (sscanf(line, "%16s %63s %63s", lfp, lkey, lval) == 3 &&
+					strcmp(lfp, fp) == 0 && strcmp(lkey, key) == 0)
+				value = strdup(lval);
+		}
+
+		fclose(f);
+	}
+
+	pthread_mutex_unlock(&mut);
+	return value;
+}
+
+// mkdir -p for the path's parent directories
+static void make_parents(char *path) {
+	for (char *c = path + 1; *c; ++c) {
+		if (*c != '/')
+			continue;
+
+		*c = '\0';
+		mkdir(path, 0755);
+		*c = '/';
+	}
+}
+
+void probecache_put(const char *key, const char *value) {
+	char *path = cache_path();
+	if (path == NULL)
+		return;
+
+	char fp[17];
+	snprintf(fp, sizeof(fp), "%016llx", (unsigned long long)fingerprint());
+
+	pthread_mutex_lock(&mut);
+	make_parents(path);
+
+	// Entries for other hosts may share the file through an NFS home;
+	// keep everything except the entry being replaced
+	size_t tmplen = strlen(path) + 32;
+	char *tmppath = malloc(tmplen);
+	snprintf(tmppath, tmplen, "%s.%i.tmp", path, (int)getpid());
+	FILE *out = fopen(tmppath, "w");
+	if (out == NULL) {
+		logperror("%s", tmppath);
+		goto done;
+	}
+
+	FILE *in = fopen(path, "r");
+	if (in) {
+		char line[256];
+		while (fgets(line, sizeof(line), in)) {
+			char lfp[17], lkey[64];
+			if (sscanf(line, "%16s %63s", lfp, lkey) == 2 &&
+					strcmp(lfp, fp) == 0 && strcmp(lkey, key) == 0)
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s %s %s\n", fp, key, value);
+	if (fclose(out) != 0 || rename(tmppath, path) < 0) {
+		logperror("%s", path);
+		unlink(tmppath);
+	}
+
+done:
+	pthread_mutex_unlock(&mut);
+	free(tmppath);
+	free(path);
+}
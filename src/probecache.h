@@ -0,0 +1,27 @@
+#ifndef PROBECACHE_H
+#define PROBECACHE_H
+
+/*
+ * Remembers the outcome of slow hardware probes between runs, so that
+ * startup can skip the ones known to fail on this machine.
+ *
+ * Entries are keyed by a fingerprint of the host, kernel, GPU drivers
+ * and libavcodec, so they're ignored once any of those change. They're
+ * stored in $XDG_CACHE_HOME/xrecord/probe (or ~/.cache/xrecord/probe).
+ * Set XRECORD_NO_PROBE_CACHE to bypass the cache.
+ */
+
+#include <stdint.h>
+
+#define PROBECACHE_HASH_INIT 0xcbf29ce484222325ull
+
+// Hash 'str' into 'h', which starts out as PROBECACHE_HASH_INIT, for keys
+// which depend on more than fits in a key (at most 63 characters, no spaces).
+uint64_t probecache_hash(uint64_t h, const char *str);
+
+// Look up 'key'. Returns a malloc'd value, or NULL if there's none.
+char *probecache_get(const char *key);
+
+void probecache_put(const char *key, const char *value);
+
+#endif
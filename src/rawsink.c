@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "rawsink.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "util.h"
+
+#define Y4M_FRAME "FRAME\n"
+
+static bool has_suffix(const char *str, const char *suffix) {
+	size_t len = strlen(str), slen = strlen(suffix);
+	return len >= slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+enum rawsink_format rawsink_format_for(const char *path, const char *format) {
+	if (format) {
+		if (strcmp(format, "rawvideo") == 0 || strcmp(format, "raw") == 0)
+			return RAWSINK_RAW;
+		if (strcmp(format, "yuv4mpegpipe") == 0 || strcmp(format, "y4m") == 0)
+			return RAWSINK_Y4M;
+		return RAWSINK_NONE;
+	}
+
+	if (has_suffix(path, ".yuv"))
+		return RAWSINK_RAW;
+	if (has_suffix(path, ".y4m"))
+		return RAWSINK_Y4M;
+	return RAWSINK_NONE;
+}
+
+static int open_target(const char *path) {
+	if (strcmp(path, "-") == 0) {
+		int fd = dup(STDOUT_FILENO);
+		if (fd < 0)
+			logperror("stdout");
+		return fd;
+	}
+
+	// Opening a FIFO blocks until there's a reader
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode))
+		logln("%s: Waiting for a reader...", path);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		logperror("%s", path);
+	return fd;
+}
+
+// Write everything, however much the kernel takes at a time
+static int write_iov(struct rawsink *s, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t written = writev(s->fd, iov, n < IOV_MAX ? n : IOV_MAX);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0) {
+			logperror("%s", s->path);
+			return -1;
+		}
+
+		while (n > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov += 1;
+			n -= 1;
+		}
+		if (n > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+static void write_y4m_header(struct rawsink *s, double fps) {
+	// Like the encoders, an unlimited frame rate is written as 1024
+	int num, den;
+	if (fps == INFINITY) {
+		num = 1024;
+		den = 1;
+	} else if (fps == (int)fps) {
+		num = fps;
+		den = 1;
+	} else {
+		num = fps * 1000 + 0.5;
+		den = 1000;
+	}
+
+	// The converter's output is limited range BT.601
+	char header[128];
+	int len = snprintf(header, sizeof(header),
+			"YUV4MPEG2 W%i H%i F%i:%i Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+			s->width, s->height, num, den);
+	struct iovec iov = { .iov_base = header, .iov_len = len };
+	if (write_iov(s, &iov, 1) < 0)
+		s->failed = true;
+}
+
+struct rawsink *rawsink_create(
+		const char *path, enum rawsink_format format, enum AVPixelFormat fmt,
+		int width, int height, double fps, _Atomic uint64_t *dropped) {
+	if (format == RAWSINK_Y4M && fmt != AV_PIX_FMT_YUV420P) {
+		logln("%s: Y4M needs yuv420p, not %s.", path, av_get_pix_fmt_name(fmt));
+		return NULL;
+	}
+
+	int fd = open_target(path);
+	if (fd < 0)
+		return NULL;
+
+	// A reader going away should end the output, not the recording
+	signal(SIGPIPE, SIG_IGN);
+
+	struct rawsink *s = calloc(1, sizeof(*s));
+	s->path = strdup(path);
+	s->fd = fd;
+	s->format = format;
+	s->fmt = fmt;
+	s->width = width;
+	s->height = height;
+	s->dropped = dropped;
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+	s->nplanes = av_pix_fmt_count_planes(fmt);
+	if (desc == NULL || s->nplanes <= 0 ||
+			av_image_fill_linesizes(s->rowsize, fmt, width) < 0)
+		panic("Unsupported pixel format %s.", av_get_pix_fmt_name(fmt));
+
+	// Chroma planes are subsampled vertically, alpha isn't
+	int nrows = 0;
+	for (int i = 0; i < s->nplanes; ++i) {
+		bool chroma = i == 1 || i == 2;
+		s->rows[i] = chroma ? -((-height) >> desc->log2_chroma_h) : height;
+		s->framesize += (size_t)s->rowsize[i] * s->rows[i];
+		nrows += s->rows[i];
+	}
+
+	// One entry per row at most, plus the frame marker
+	s->iovcap = nrows + 1;
+	s->iov = malloc(sizeof(*s->iov) * s->iovcap);
+
+	// A pipe which holds a whole frame saves the reader some wakeups;
+	// if we aren't allowed one that big, the default does too
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+		fcntl(fd, F_SETPIPE_SZ, (int)(s->framesize + strlen(Y4M_FRAME)));
+
+	if (format == RAWSINK_Y4M)
+		write_y4m_header(s, fps);
+
+	logln("%s: Writing %ix%i %s %s.", path, width, height, av_get_pix_fmt_name(fmt),
+			format == RAWSINK_Y4M ? "Y4M" : "raw video");
+	return s;
+}
+
+ssize_t rawsink_write(struct rawsink *s, const AVFrame *frame) {
+	if (s->failed) {
+		atomic_fetch_add_explicit(s->dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	int n = 0;
+	if (s->format == RAWSINK_Y4M)
+		s->iov[n++] = (struct iovec) { .iov_base = Y4M_FRAME, .iov_len = strlen(Y4M_FRAME) };
+
+	// Rows which follow each other in memory, like whole planes without
+	// padding, go in the same entry
+	for (int i = 0; i < s->nplanes; ++i) {
+		for (int y = 0; y < s->rows[i]; ++y) {
+			uint8_t *row = frame->data[i] + (size_t)y * frame->linesize[i];
+			struct iovec *prev = n > 0 ? &s->iov[n - 1] : NULL;
+			if (prev && (uint8_t *)prev->iov_base + prev->iov_len == row)
+				prev->iov_len += s->rowsize[i];
+			else
+				s->iov[n++] = (struct iovec) { .iov_base = row, .iov_len = s->rowsize[i] };
+		}
+	}
+
+	size_t len = 0;
+	for (int i = 0; i < n; ++i)
+		len += s->iov[i].iov_len;
+
+	if (write_iov(s, s->iov, n) < 0) {
+		logln("%s: Reader went away, dropping the rest of the frames.", s->path);
+		s->failed = true;
+		atomic_fetch_add_explicit(s->dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	return len;
+}
+
+void rawsink_free(struct rawsink *s) {
+	if (close(s->fd) < 0)
+		logperror("%s", s->path);
+	free(s->iov);
+	free(s->path);
+	free(s);
+}
@@ -0,0 +1,59 @@
+#ifndef RAWSINK_H
+#define RAWSINK_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * Converted frames written out as they are, without an encoder:
+ * raw planes, or YUV4MPEG2 for tools which want to know the format.
+ * The rows of each plane are written straight from the frame with writev,
+ * skipping the linesize padding, so nothing is packed or copied on our side.
+ * Writes block, so the pipeline goes as fast as the pipe or disk takes it.
+ */
+
+enum rawsink_format {
+	RAWSINK_NONE,
+	RAWSINK_RAW,
+	RAWSINK_Y4M,
+};
+
+struct rawsink {
+	char *path;
+	int fd;
+	enum rawsink_format format;
+	enum AVPixelFormat fmt;
+	int width;
+	int height;
+
+	// Bytes per row and rows of each plane, without padding
+	int nplanes;
+	int rowsize[4];
+	int rows[4];
+	size_t framesize;
+
+	struct iovec *iov;
+	int iovcap;
+
+	_Atomic uint64_t *dropped;
+	bool failed; // The reader went away; frames are dropped
+};
+
+// The format to write 'path' in, from the --format name ("rawvideo" or "raw",
+// "yuv4mpegpipe" or "y4m"), or otherwise its extension (".yuv" or ".y4m").
+enum rawsink_format rawsink_format_for(const char *path, const char *format);
+
+// Open 'path', which may be "-" for stdout, and write the Y4M header if any.
+// Frames which can't be written because the reader went away are counted in 'dropped'.
+struct rawsink *rawsink_create(
+		const char *path, enum rawsink_format format, enum AVPixelFormat fmt,
+		int width, int height, double fps, _Atomic uint64_t *dropped);
+
+// Write a frame. Returns the number of bytes written, or -1.
+ssize_t rawsink_write(struct rawsink *s, const AVFrame *frame);
+
+void rawsink_free(struct rawsink *s);
+
+#endif
@@ -0,0 +1,53 @@
+#include "reorder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+struct reorder *reorder_create(size_t size, int window, reorder_emit emit, void *opaque) {
+	struct reorder *r = malloc(sizeof(*r));
+	pthread_mutex_init(&r->mut, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->size = size;
+	r->window = window;
+	r->next = 0;
+	r->ready = calloc(window, sizeof(*r->ready));
+	r->data = malloc(size * window);
+	assume(r->ready != NULL && r->data != NULL);
+	r->emit = emit;
+	r->opaque = opaque;
+	return r;
+}
+
+void reorder_put(struct reorder *r, int64_t seq, void *item) {
+	pthread_mutex_lock(&r->mut);
+	while (seq >= r->next + r->window)
+		pthread_cond_wait(&r->cond, &r->mut);
+
+	int slot = seq % r->window;
+	memcpy(r->data + r->size * slot, item, r->size);
+	r->ready[slot] = true;
+
+	// Emit the run of ready items starting at the next one
+	bool emitted = false;
+	while (r->ready[r->next % r->window]) {
+		slot = r->next % r->window;
+		r->emit(r->opaque, r->data + r->size * slot);
+		r->ready[slot] = false;
+		r->next += 1;
+		emitted = true;
+	}
+
+	if (emitted)
+		pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mut);
+}
+
+void reorder_free(struct reorder *r) {
+	pthread_mutex_destroy(&r->mut);
+	pthread_cond_destroy(&r->cond);
+	free(r->ready);
+	free(r->data);
+	free(r);
+}
@@ -0,0 +1,40 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Restores the order of items which parallel workers finish out of order.
+ * Items are numbered from 0 without gaps; each is passed to 'emit' once
+ * all items before it have been, in the thread which completed the run.
+ * Emitting happens with the reorder buffer locked, so 'emit' is never
+ * called concurrently.
+ */
+
+typedef void (*reorder_emit)(void *opaque, void *item);
+
+struct reorder {
+	pthread_mutex_t mut;
+	pthread_cond_t cond;
+	size_t size;
+	int window;
+	int64_t next;
+	bool *ready;
+	unsigned char *data;
+
+	reorder_emit emit;
+	void *opaque;
+};
+
+// 'window' is the most items which can be in flight at once.
+struct reorder *reorder_create(size_t size, int window, reorder_emit emit, void *opaque);
+
+// Hand in item number 'seq'. Blocks if it's more than 'window' items ahead.
+void reorder_put(struct reorder *r, int64_t seq, void *item);
+
+void reorder_free(struct reorder *r);
+
+#endif
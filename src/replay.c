@@ -0,0 +1,257 @@
+#include "replay.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "util.h"
+
+#define MAX_REPLAYS 8
+
+// Registry for replay_request_dump, which may run in a signal handler on
+// any thread. Slots are only ever set and cleared atomically, and a replay
+// isn't freed while a dump request may still be looking at it.
+static struct replay *_Atomic replays[MAX_REPLAYS];
+static atomic_int dumps_in_flight;
+
+static double pkt_time(struct replay *r, AVPacket *pkt) {
+	return pkt->pts * av_q2d(r->time_base);
+}
+
+static void drop_head(struct replay *r) {
+	struct replay_pkt *rp = r->head;
+	r->head = rp->next;
+	if (r->head == NULL)
+		r->tail = NULL;
+
+	r->bytes -= rp->pkt->size;
+	av_packet_free(&rp->pkt);
+	free(rp);
+}
+
+// Find the first keyframe after the head
+static struct replay_pkt *next_keyframe(struct replay *r) {
+	for (struct replay_pkt *rp = r->head->next; rp; rp = rp->next) {
+		if (rp->pkt->flags & AV_PKT_FLAG_KEY)
+			return rp;
+	}
+
+	return NULL;
+}
+
+// Drop whole GOPs from the front until we're within budget,
+// while keeping at least r->seconds of video.
+// Must be called with r->mut held.
+static void trim(struct replay *r) {
+	double newest = pkt_time(r, r->tail->pkt);
+	while (r->head) {
+		struct replay_pkt *next = next_keyframe(r);
+		if (next == NULL) {
+			if (r->bytes <= r->budget)
+				break;
+
+			// A single GOP doesn't fit; start over at the next keyframe
+			logln("Replay buffer: GOP exceeds memory budget, dropping it.");
+			while (r->head)
+				drop_head(r);
+			r->need_keyframe = true;
+			break;
+		}
+
+		if (r->bytes <= r->budget && newest - pkt_time(r, next->pkt) < r->seconds)
+			break;
+
+		while (r->head != next)
+			drop_head(r);
+	}
+}
+
+static void dump(struct replay *r) {
+	// Take references to the packets, so that the encoder can keep going
+	pthread_mutex_lock(&r->mut);
+	int count = 0;
+	for (struct replay_pkt *rp = r->head; rp; rp = rp->next)
+		count += 1;
+
+	AVPacket **pkts = malloc(sizeof(*pkts) * (count ? count : 1));
+	int n = 0;
+	for (struct replay_pkt *rp = r->head; rp; rp = rp->next) {
+		pkts[n] = av_packet_clone(rp->pkt);
+		if (pkts[n] == NULL)
+			panic("Failed to clone packet.");
+		n += 1;
+	}
+	pthread_mutex_unlock(&r->mut);
+
+	if (n == 0) {
+		logln("Replay buffer is empty, not dumping.");
+		free(pkts);
+		return;
+	}
+
+	// Insert the dump number before the extension
+	r->dumps += 1;
+	const char *path = r->muxconf.path;
+	const char *ext = strrchr(path, '.');
+	if (ext == NULL || strchr(ext, '/'))
+		ext = path + strlen(path);
+
+	char *dumppath = malloc(strlen(path) + 16);
+	sprintf(dumppath, "%.*s-%i%s", (int)(ext - path), path, r->dumps, ext);
+
+	struct muxconf muxconf = r->muxconf;
+	muxconf.path = dumppath;
+
+	struct mux *mux = mux_create(&muxconf);
+	if (mux == NULL || mux_start_params(mux, r->par, r->time_base, r->framerate) < 0) {
+		logln("Failed to dump replay buffer to %s.", dumppath);
+		if (mux)
+			mux_free(mux);
+		for (int i = 0; i < n; ++i)
+			av_packet_free(&pkts[i]);
+		free(pkts);
+		free(dumppath);
+		return;
+	}
+
+	// Make the dump start at zero
+	int64_t offset = pkts[0]->dts != AV_NOPTS_VALUE ? pkts[0]->dts : pkts[0]->pts;
+	double duration = pkt_time(r, pkts[n - 1]) - pkt_time(r, pkts[0]);
+	for (int i = 0; i < n; ++i) {
+		if (pkts[i]->pts != AV_NOPTS_VALUE)
+			pkts[i]->pts -= offset;
+		if (pkts[i]->dts != AV_NOPTS_VALUE)
+			pkts[i]->dts -= offset;
+
+		if (mux_write(mux, pkts[i]) < 0)
+			logln("Failed to write packet to %s.", dumppath);
+		av_packet_free(&pkts[i]);
+	}
+
+	mux_free(mux);
+	logln("Dumped %.1fs (%i packets) to %s.", duration, n, dumppath);
+	free(pkts);
+	free(dumppath);
+}
+
+static void *replay_thread(void *arg) {
+	struct replay *r = (struct replay *)arg;
+
+	while (1) {
+		while (sem_wait(&r->sem) < 0 && errno == EINTR);
+
+		pthread_mutex_lock(&r->mut);
+		bool closed = r->closed;
+		pthread_mutex_unlock(&r->mut);
+		if (closed)
+			break;
+
+		dump(r);
+	}
+
+	return NULL;
+}
+
+struct replay *replay_create(
+		struct muxconf *muxconf, AVCodecContext *avctx,
+		double seconds, size_t budget) {
+	struct replay *r = malloc(sizeof(*r));
+	r->muxconf = *muxconf;
+	r->par = avcodec_parameters_alloc();
+	if (r->par == NULL || avcodec_parameters_from_context(r->par, avctx) < 0)
+		panic("Failed to get codec parameters.");
+	r->time_base = avctx->time_base;
+	r->framerate = avctx->framerate;
+
+	r->seconds = seconds;
+	r->budget = budget;
+
+	pthread_mutex_init(&r->mut, NULL);
+	r->head = NULL;
+	r->tail = NULL;
+	r->bytes = 0;
+	r->need_keyframe = true;
+
+	sem_init(&r->sem, 0, 0);
+	r->closed = false;
+	r->dumps = 0;
+	pthread_create(&r->thread, NULL, replay_thread, r);
+
+	int slot = 0;
+	struct replay *empty = NULL;
+	while (slot < MAX_REPLAYS && !atomic_compare_exchange_strong(&replays[slot], &empty, r)) {
+		slot += 1;
+		empty = NULL;
+	}
+	assume(slot < MAX_REPLAYS);
+
+	logln("Keeping the last %.1fs (max %zu MiB) of %s in memory. Send SIGUSR1 to dump.",
+			seconds, budget / (1024 * 1024), muxconf->path);
+	return r;
+}
+
+void replay_push(struct replay *r, AVPacket *pkt) {
+	struct replay_pkt *rp = malloc(sizeof(*rp));
+	rp->next = NULL;
+	rp->pkt = av_packet_alloc();
+	if (rp->pkt == NULL)
+		panic("Failed to allocate AVPacket.");
+	av_packet_move_ref(rp->pkt, pkt);
+
+	pthread_mutex_lock(&r->mut);
+
+	if (r->need_keyframe) {
+		if (!(rp->pkt->flags & AV_PKT_FLAG_KEY)) {
+			pthread_mutex_unlock(&r->mut);
+			av_packet_free(&rp->pkt);
+			free(rp);
+			return;
+		}
+
+		r->need_keyframe = false;
+	}
+
+	if (r->tail)
+		r->tail->next = rp;
+	else
+		r->head = rp;
+	r->tail = rp;
+	r->bytes += rp->pkt->size;
+
+	trim(r);
+	pthread_mutex_unlock(&r->mut);
+}
+
+void replay_request_dump() {
+	atomic_fetch_add(&dumps_in_flight, 1);
+	for (int i = 0; i < MAX_REPLAYS; ++i) {
+		struct replay *r = atomic_load(&replays[i]);
+		if (r)
+			sem_post(&r->sem);
+	}
+	atomic_fetch_sub(&dumps_in_flight, 1);
+}
+
+void replay_free(struct replay *r) {
+	// Once unregistered, wait out any dump request which got hold of us before
+	for (int i = 0; i < MAX_REPLAYS; ++i) {
+		struct replay *expected = r;
+		atomic_compare_exchange_strong(&replays[i], &expected, NULL);
+	}
+	while (atomic_load(&dumps_in_flight) > 0)
+		sched_yield();
+
+	pthread_mutex_lock(&r->mut);
+	r->closed = true;
+	pthread_mutex_unlock(&r->mut);
+	sem_post(&r->sem);
+	pthread_join(r->thread, NULL);
+
+	while (r->head)
+		drop_head(r);
+
+	pthread_mutex_destroy(&r->mut);
+	sem_destroy(&r->sem);
+	avcodec_parameters_free(&r->par);
+	free(r);
+}
@@ -0,0 +1,58 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <libavcodec/avcodec.h>
+
+#include "mux.h"
+
+/*
+ * The replay buffer keeps the last few seconds of encoded packets in memory,
+ * and writes them to a file when asked to.
+ * The buffer always starts at a keyframe.
+ */
+
+struct replay_pkt {
+	struct replay_pkt *next;
+	AVPacket *pkt;
+};
+
+struct replay {
+	// Dumps are written to the path with a number before the extension
+	struct muxconf muxconf;
+	AVCodecParameters *par;
+	AVRational time_base;
+	AVRational framerate;
+
+	double seconds;
+	size_t budget;
+
+	pthread_mutex_t mut;
+	struct replay_pkt *head;
+	struct replay_pkt *tail;
+	size_t bytes;
+	bool need_keyframe;
+
+	pthread_t thread;
+	sem_t sem;
+	bool closed;
+	int dumps;
+};
+
+// Keep at least 'seconds' of video, but never more than 'budget' bytes.
+struct replay *replay_create(
+		struct muxconf *muxconf, AVCodecContext *avctx,
+		double seconds, size_t budget);
+
+// Add a packet, taking ownership of its reference.
+void replay_push(struct replay *r, AVPacket *pkt);
+
+// Ask every replay buffer to write its contents to a file, e.g on SIGUSR1
+// or a "dump" request on the stats socket. Async-signal-safe.
+void replay_request_dump();
+
+void replay_free(struct replay *r);
+
+#endif
@@ -13,6 +13,7 @@ struct ringbuf *ringbuf_create(size_t size, size_t nmemb) {
 	rb->ri = 0;
 	rb->wi = 0;
 	rb->used = 0;
+	rb->closed = false;
 	return rb;
 }
 
@@ -59,9 +60,14 @@ void *ringbuf_read_start(struct ringbuf *rb) {
 	pthread_mutex_lock(&rb->mut);
 
 	// Wait for data to be available if necessary
-	while (rb->used == 0)
+	while (rb->used == 0 && !rb->closed)
 		pthread_cond_wait(&rb->cond_data, &rb->mut);
 
+	if (rb->used == 0) {
+		pthread_mutex_unlock(&rb->mut);
+		return NULL;
+	}
+
 	pthread_mutex_unlock(&rb->mut);
 	return rb->data + rb->size * rb->ri;
 }
@@ -74,7 +80,64 @@ void ringbuf_read_end(struct ringbuf *rb) {
 	pthread_mutex_unlock(&rb->mut);
 }
 
-void ringbuf_read(struct ringbuf *rb, void *data) {
-	memcpy(data, ringbuf_read_start(rb), rb->size);
+bool ringbuf_read(struct ringbuf *rb, void *data) {
+	void *src = ringbuf_read_start(rb);
+	if (src == NULL)
+		return false;
+
+	memcpy(data, src, rb->size);
 	ringbuf_read_end(rb);
+	return true;
+}
+
+void ringbuf_close(struct ringbuf *rb) {
+	pthread_mutex_lock(&rb->mut);
+	rb->closed = true;
+	pthread_cond_broadcast(&rb->cond_data);
+	pthread_mutex_unlock(&rb->mut);
+}
+
+void ringbuf_push(struct ringbuf *rb, void *data) {
+	pthread_mutex_lock(&rb->mut);
+	while (rb->used == rb->nmemb)
+		pthread_cond_wait(&rb->cond_space, &rb->mut);
+
+	memcpy(rb->data + rb->size * rb->wi, data, rb->size);
+	rb->wi = (rb->wi + 1) % rb->nmemb;
+	rb->used += 1;
+	pthread_cond_signal(&rb->cond_data);
+	pthread_mutex_unlock(&rb->mut);
+}
+
+// Must be called with the lock held
+static bool take(struct ringbuf *rb, void *data) {
+	if (rb->used == 0)
+		return false;
+
+	memcpy(data, rb->data + rb->size * rb->ri, rb->size);
+	rb->ri = (rb->ri + 1) % rb->nmemb;
+	rb->used -= 1;
+	pthread_cond_signal(&rb->cond_space);
+	return true;
+}
+
+bool ringbuf_pop(struct ringbuf *rb, void *data) {
+	pthread_mutex_lock(&rb->mut);
+	while (rb->used == 0 && !rb->closed)
+		pthread_cond_wait(&rb->cond_data, &rb->mut);
+
+	bool ret = take(rb, data);
+	pthread_mutex_unlock(&rb->mut);
+	return ret;
+}
+
+bool ringbuf_trypop(struct ringbuf *rb, void *data) {
+	pthread_mutex_lock(&rb->mut);
+	bool ret = take(rb, data);
+	pthread_mutex_unlock(&rb->mut);
+	return ret;
+}
+
+int ringbuf_used(struct ringbuf *rb) {
+	return __atomic_load_n(&rb->used, __ATOMIC_RELAXED);
 }
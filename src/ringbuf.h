@@ -2,6 +2,7 @@
 #define QUEUE_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 struct ringbuf {
@@ -13,6 +14,7 @@ struct ringbuf {
 	int ri;
 	int wi;
 	int used;
+	bool closed;
 	unsigned char data[];
 };
 
@@ -26,8 +28,26 @@ void *ringbuf_write_start(struct ringbuf *rb);
 void ringbuf_write_end(struct ringbuf *rb);
 void ringbuf_write(struct ringbuf *cb, void *data);
 
+// Returns NULL once the ringbuf is closed and drained.
 void *ringbuf_read_start(struct ringbuf *rb);
 void ringbuf_read_end(struct ringbuf *rb);
-void ringbuf_read(struct ringbuf *cb, void *data);
+
+// Returns false once the ringbuf is closed and drained.
+bool ringbuf_read(struct ringbuf *cb, void *data);
+
+// Copy an element in or out entirely under the lock, so that any number
+// of threads can push and pop concurrently. pop returns false once
+// the ringbuf is closed and drained.
+void ringbuf_push(struct ringbuf *rb, void *data);
+bool ringbuf_pop(struct ringbuf *rb, void *data);
+
+// Like ringbuf_pop, but returns false right away if the ringbuf is empty.
+bool ringbuf_trypop(struct ringbuf *rb, void *data);
+
+// Number of filled slots, without taking the lock.
+int ringbuf_used(struct ringbuf *rb);
+
+// Signal that no more data will be written.
+void ringbuf_close(struct ringbuf *rb);
 
 #endif
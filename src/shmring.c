@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "util.h"
+
+#define PREFIX "shm:"
+#define MAGIC 0x78726563 // "xrec"
+#define VERSION 1
+#define LINESIZE_ALIGN 64
+#define SLOT_WRITING UINT64_MAX
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+// The frame info is only valid while 'seq' is the same before and after reading it
+struct shmring_slot {
+	_Atomic uint64_t seq;
+	int64_t id;
+	uint64_t cap_start;
+	uint64_t cap_end;
+	uint64_t conv_start;
+	uint64_t conv_end;
+	uint64_t paused_ns;
+};
+
+struct shmring_header {
+	uint32_t magic;
+	uint32_t version;
+	char pix_fmt[32];
+	int32_t width;
+	int32_t height;
+	int32_t linesize[4];
+	double fps;
+	uint64_t frame_size;
+	uint64_t frames_offset;
+	uint32_t nslots;
+
+	_Atomic uint32_t futex; // Bumped for every frame, and when closing
+	_Atomic uint32_t closed;
+	_Atomic uint64_t head; // Sequence number of the next frame
+	struct shmring_slot slots[];
+};
+
+static size_t page_align(size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+}
+
+static void frame_pointers(struct shmring *ring, uint64_t seq, uint8_t *data[4]) {
+	uint8_t *base = (uint8_t *)ring->hdr + ring->frames_offset + (seq % ring->nslots) * ring->frame_size;
+	av_image_fill_pointers(data, ring->fmt, ring->height, base, ring->linesize);
+}
+
+bool shmring_is_target(const char *path) {
+	return strncmp(path, PREFIX, strlen(PREFIX)) == 0;
+}
+
+/*
+ * Server
+ */
+
+static void send_fd(struct shmring *ring, int conn, int fd) {
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0)
+		logperror("%s: sendmsg", ring->path);
+}
+
+static void accept_consumer(struct shmring *ring) {
+	int conn = accept4(ring->sockfd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn < 0) {
+		logperror("%s: accept", ring->path);
+		return;
+	}
+
+	if (ring->nconsumers == SHMRING_MAX_CONSUMERS) {
+		logln("%s: Too many consumers (max %i).", ring->path, SHMRING_MAX_CONSUMERS);
+		close(conn);
+		return;
+	}
+
+	// Consumers only get to read; the descriptor is reopened read-only
+	char procpath[64];
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%i", ring->fd);
+	int rofd = open(procpath, O_RDONLY | O_CLOEXEC);
+	if (rofd < 0) {
+		logperror("%s", procpath);
+		close(conn);
+		return;
+	}
+
+	send_fd(ring, conn, rofd);
+	close(rofd);
+
+	// We keep the connection, so that consumers notice if we go away
+	ring->consumers[ring->nconsumers++] = conn;
+	logln("%s: Consumer attached, %i in total.", ring->path, ring->nconsumers);
+}
+
+static void *server_thread(void *arg) {
+	struct shmring *ring = (struct shmring *)arg;
+
+	while (1) {
+		struct pollfd fds[SHMRING_MAX_CONSUMERS + 2] = {
+			{ .fd = ring->sockfd, .events = POLLIN },
+			{ .fd = ring->stopfd[0], .events = POLLIN },
+		};
+		for (int i = 0; i < ring->nconsumers; ++i)
+			fds[i + 2] = (struct pollfd) { .fd = ring->consumers[i], .events = POLLIN };
+
+		if (poll(fds, ring->nconsumers + 2, -1) < 0 && errno != EINTR)
+			ppanic("poll");
+		if (fds[1].revents)
+			break;
+
+		// Consumers never send anything, so readable means they're gone
+		for (int i = ring->nconsumers - 1; i >= 0; --i) {
+			if (fds[i + 2].revents == 0)
+				continue;
+
+			close(ring->consumers[i]);
+			ring->consumers[i] = ring->consumers[--ring->nconsumers];
+			logln("%s: Consumer detached, %i left.", ring->path, ring->nconsumers);
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_consumer(ring);
+	}
+
+	return NULL;
+}
+
+static int listen_on(struct shmring *ring) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(ring->path) >= sizeof(addr.sun_path)) {
+		logln("%s: Socket path too long.", ring->path);
+		return -1;
+	}
+	strcpy(addr.sun_path, ring->path);
+
+	ring->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ring->sockfd < 0) {
+		logperror("socket");
+		return -1;
+	}
+
+	// Replace a socket left behind by an earlier run
+	unlink(ring->path);
+	if (bind(ring->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(ring->sockfd, 8) < 0) {
+		logperror("%s", ring->path);
+		close(ring->sockfd);
+		return -1;
+	}
+
+	if (pipe2(ring->stopfd, O_CLOEXEC) < 0) {
+		logperror("pipe");
+		close(ring->sockfd);
+		unlink(ring->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct shmring *shmring_create(
+		const char *target, enum AVPixelFormat fmt, int width, int height,
+		double fps, int nslots) {
+	struct shmring *ring = calloc(1, sizeof(*ring));
+	ring->fmt = fmt;
+	ring->width = width;
+	ring->height = height;
+	ring->fps = fps;
+	ring->path = strdup(shmring_is_target(target) ? target + strlen(PREFIX) : target);
+
+	// Same layout as the frame pools, so that frames are copied plane by plane as-is
+	int linesize[4];
+	if (av_image_fill_linesizes(linesize, fmt, width) < 0)
+		panic("Failed to get linesizes for %s.", av_get_pix_fmt_name(fmt));
+	for (int i = 0; i < 4; ++i)
+		linesize[i] = (linesize[i] + LINESIZE_ALIGN - 1) & ~(LINESIZE_ALIGN - 1);
+
+	uint8_t *data[4];
+	int frame_size = av_image_fill_pointers(data, fmt, height, NULL, linesize);
+	if (frame_size < 0)
+		panic("Failed to get frame size for %s.", av_get_pix_fmt_name(fmt));
+
+	memcpy(ring->linesize, linesize, sizeof(linesize));
+	ring->frame_size = page_align(frame_size);
+	ring->frames_offset = page_align(
+			sizeof(struct shmring_header) + sizeof(struct shmring_slot) * nslots);
+	ring->nslots = nslots;
+	ring->size = ring->frames_offset + ring->frame_size * nslots;
+
+	// Sealed, so that the consumers can trust the size
+	ring->fd = memfd_create("xrecord-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (ring->fd < 0) {
+		logperror("memfd_create");
+		goto err_free;
+	}
+	if (ftruncate(ring->fd, ring->size) < 0) {
+		logperror("ftruncate");
+		goto err_close;
+	}
+	if (fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+		logperror("%s: F_ADD_SEALS", ring->path);
+
+	ring->hdr = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->hdr == MAP_FAILED) {
+		logperror("mmap");
+		goto err_close;
+	}
+
+	// The memfd's inode is writable by anyone, so a consumer could reopen
+	// its descriptor for writing; only our own mapping may write. Needs Linux 5.1.
+	if (fcntl(ring->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+		logperror("%s: F_SEAL_FUTURE_WRITE, consumers may write to the ring", ring->path);
+		if (fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SEAL) < 0)
+			logperror("%s: F_ADD_SEALS", ring->path);
+	}
+
+	struct shmring_header *hdr = ring->hdr;
+	hdr->magic = MAGIC;
+	hdr->version = VERSION;
+	snprintf(hdr->pix_fmt, sizeof(hdr->pix_fmt), "%s", av_get_pix_fmt_name(fmt));
+	hdr->width = width;
+	hdr->height = height;
+	memcpy(hdr->linesize, ring->linesize, sizeof(ring->linesize));
+	hdr->fps = fps;
+	hdr->frame_size = ring->frame_size;
+	hdr->frames_offset = ring->frames_offset;
+	hdr->nslots = ring->nslots;
+
+	if (listen_on(ring) < 0)
+		goto err_unmap;
+
+	pthread_create(&ring->thread, NULL, server_thread, ring);
+	logln("Serving %ix%i %s frames on %s.", width, height, hdr->pix_fmt, ring->path);
+	return ring;
+
+err_unmap:
+	munmap(ring->hdr, ring->size);
+err_close:
+	close(ring->fd);
+err_free:
+	free(ring->path);
+	free(ring);
+	return NULL;
+}
+
+void shmring_publish(struct shmring *ring, const AVFrame *frame, const struct frameinfo *fi) {
+	struct shmring_header *hdr = ring->hdr;
+	uint64_t seq = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	struct shmring_slot *slot = &hdr->slots[seq % ring->nslots];
+
+	// Readers of the slot's previous frame will see that it changed under them
+	atomic_store_explicit(&slot->seq, SLOT_WRITING, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	uint8_t *data[4];
+	frame_pointers(ring, seq, data);
+	av_image_copy(data, ring->linesize, (const uint8_t **)frame->data, frame->linesize,
+			ring->fmt, ring->width, ring->height);
+
+	if (fi) {
+		slot->id = fi->id;
+		slot->cap_start = fi->cap_start;
+		slot->cap_end = fi->cap_end;
+		slot->conv_start = fi->conv_start;
+		slot->conv_end = fi->conv_end;
+		slot->paused_ns = fi->paused_ns;
+	}
+
+	atomic_store_explicit(&slot->seq, seq, memory_order_release);
+	atomic_store_explicit(&hdr->head, seq + 1, memory_order_release);
+	atomic_fetch_add(&hdr->futex, 1);
+	syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Consumer
+ */
+
+static int recv_fd(int conn) {
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) <= 0)
+		return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+struct shmring *shmring_attach(const char *path) {
+	if (shmring_is_target(path))
+		path += strlen(PREFIX);
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logln("%s: Socket path too long.", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct shmring *ring = calloc(1, sizeof(*ring));
+	ring->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ring->fd < 0) {
+		logperror("socket");
+		goto err_free;
+	}
+	if (connect(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		logperror("%s", path);
+		goto err_close;
+	}
+
+	int memfd = recv_fd(ring->fd);
+	if (memfd < 0) {
+		logln("%s: Didn't get a frame ring from the server.", path);
+		goto err_close;
+	}
+
+	struct stat st;
+	if (fstat(memfd, &st) < 0) {
+		logperror("%s: fstat", path);
+		close(memfd);
+		goto err_close;
+	}
+
+	ring->size = st.st_size;
+	ring->hdr = mmap(NULL, ring->size, PROT_READ, MAP_SHARED, memfd, 0);
+	close(memfd);
+	if (ring->hdr == MAP_FAILED) {
+		logperror("%s: mmap", path);
+		goto err_close;
+	}
+
+	struct shmring_header *hdr = ring->hdr;
+	if (ring->size < sizeof(*hdr) || hdr->magic != MAGIC || hdr->version != VERSION) {
+		logln("%s: Not a frame ring of a compatible version.", path);
+		goto err_unmap;
+	}
+
+	// The layout is only read once, and checked against the size
+	memcpy(ring->linesize, hdr->linesize, sizeof(ring->linesize));
+	ring->frame_size = hdr->frame_size;
+	ring->frames_offset = hdr->frames_offset;
+	ring->nslots = hdr->nslots;
+	if (ring->nslots == 0 ||
+			ring->frames_offset < sizeof(*hdr) + sizeof(struct shmring_slot) * ring->nslots ||
+			ring->size < ring->frames_offset + ring->frame_size * ring->nslots) {
+		logln("%s: Frame ring is corrupt.", path);
+		goto err_unmap;
+	}
+
+	ring->fmt = av_get_pix_fmt(hdr->pix_fmt);
+	ring->width = hdr->width;
+	ring->height = hdr->height;
+	ring->fps = hdr->fps;
+	if (ring->fmt == AV_PIX_FMT_NONE) {
+		logln("%s: Unknown pixel format '%s'.", path, hdr->pix_fmt);
+		goto err_unmap;
+	}
+
+	// Start with the next frame, like a capture would
+	ring->next = atomic_load_explicit(&hdr->head, memory_order_acquire);
+	logln("Attached to %ix%i %s frames on %s.", ring->width, ring->height, hdr->pix_fmt, path);
+	return ring;
+
+err_unmap:
+	munmap(ring->hdr, ring->size);
+err_close:
+	close(ring->fd);
+err_free:
+	free(ring);
+	return NULL;
+}
+
+// The server keeps our connection open for as long as it runs
+static bool server_gone(struct shmring *ring) {
+	struct pollfd pfd = { .fd = ring->fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+int shmring_read(struct shmring *ring, AVFrame *frame, struct frameinfo *fi, int timeout_ms) {
+	struct shmring_header *hdr = ring->hdr;
+
+	while (1) {
+		uint32_t futexval = atomic_load(&hdr->futex);
+		if (atomic_load(&hdr->closed))
+			return -1;
+
+		uint64_t head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+		if (ring->next >= head) {
+			struct timespec ts = {
+				.tv_sec = timeout_ms / 1000,
+				.tv_nsec = (long)(timeout_ms % 1000) * 1000000,
+			};
+			if (syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, futexval, &ts, NULL, 0) < 0) {
+				if (errno == ETIMEDOUT)
+					return server_gone(ring) ? -1 : 0;
+				if (errno == EINTR)
+					return 0;
+			}
+			continue;
+		}
+
+		// The oldest frame may be being overwritten already, so skip to the newest
+		if (head - ring->next >= ring->nslots) {
+			ring->skipped += head - 1 - ring->next;
+			ring->next = head - 1;
+		}
+
+		uint64_t seq = ring->next;
+		struct shmring_slot *slot = &hdr->slots[seq % ring->nslots];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq) {
+			ring->skipped += 1;
+			ring->next += 1;
+			continue;
+		}
+
+		uint8_t *data[4];
+		frame_pointers(ring, seq, data);
+		av_image_copy(frame->data, frame->linesize, (const uint8_t **)data, ring->linesize,
+				ring->fmt, ring->width, ring->height);
+		if (fi) {
+			fi->id = slot->id;
+			fi->cap_start = slot->cap_start;
+			fi->cap_end = slot->cap_end;
+			fi->conv_start = slot->conv_start;
+			fi->conv_end = slot->conv_end;
+			fi->paused_ns = slot->paused_ns;
+		}
+
+		// If the server got to the slot while we copied, the frame is torn
+		atomic_thread_fence(memory_order_acquire);
+		ring->next += 1;
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+			ring->skipped += 1;
+			continue;
+		}
+
+		return 1;
+	}
+}
+
+void shmring_free(struct shmring *ring) {
+	if (ring->path) {
+		// Consumers waiting for a frame get woken up to find the ring closed
+		atomic_store(&ring->hdr->closed, 1);
+		atomic_fetch_add(&ring->hdr->futex, 1);
+		syscall(SYS_futex, &ring->hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+		// Closing the write end wakes up the server thread
+		close(ring->stopfd[1]);
+		pthread_join(ring->thread, NULL);
+		for (int i = 0; i < ring->nconsumers; ++i)
+			close(ring->consumers[i]);
+		close(ring->stopfd[0]);
+		close(ring->sockfd);
+		unlink(ring->path);
+		free(ring->path);
+	}
+
+	munmap(ring->hdr, ring->size);
+	close(ring->fd);
+	free(ring);
+}
@@ -0,0 +1,79 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+#include "latency.h"
+
+/*
+ * Converted frames shared with other processes, through a ring of frames
+ * in a memfd. The server hands out read-only descriptors for the memfd on
+ * a Unix socket ("shm:<path>"), and publishes frames without ever waiting
+ * for a consumer; consumers wait on a futex in the ring's header, and
+ * a consumer which falls a whole ring behind skips to the newest frame.
+ * Consumers can thus come and go without the server noticing,
+ * except in the log.
+ */
+
+#define SHMRING_MAX_CONSUMERS 32
+
+struct shmring_header;
+
+struct shmring {
+	struct shmring_header *hdr;
+	size_t size;
+	int fd; // The memfd for the server, the socket for a consumer
+
+	// Format of the frames
+	enum AVPixelFormat fmt;
+	int width;
+	int height;
+	double fps;
+
+	// Layout of the ring. Kept apart from the shared header, so that
+	// nothing another process writes there can move our copies around.
+	int linesize[4];
+	size_t frame_size;
+	size_t frames_offset;
+	uint32_t nslots;
+
+	// Server only
+	char *path;
+	int sockfd;
+	int stopfd[2];
+	int consumers[SHMRING_MAX_CONSUMERS];
+	int nconsumers;
+	pthread_t thread;
+
+	// Consumer only
+	uint64_t next; // Sequence number of the next frame to read
+	uint64_t skipped; // Frames overwritten before we got to them
+};
+
+// Whether 'path' names a shared memory output, i.e starts with "shm:".
+bool shmring_is_target(const char *path);
+
+// Create a ring of 'nslots' frames and serve it on the socket in 'target'.
+// The frame rate is only passed on to the consumers.
+struct shmring *shmring_create(
+		const char *target, enum AVPixelFormat fmt, int width, int height,
+		double fps, int nslots);
+
+// Copy a frame into the ring. Never blocks.
+void shmring_publish(struct shmring *ring, const AVFrame *frame, const struct frameinfo *fi);
+
+// Attach to the ring served on 'path' ("shm:" is optional).
+struct shmring *shmring_attach(const char *path);
+
+// Copy the next frame into 'frame', which must match the ring's format and size.
+// Returns 1 with a frame, 0 if none was published within 'timeout_ms',
+// or -1 once the server has gone away.
+int shmring_read(struct shmring *ring, AVFrame *frame, struct frameinfo *fi, int timeout_ms);
+
+// Stop serving and wake up the consumers, or detach from the ring.
+void shmring_free(struct shmring *ring);
+
+#endif
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include "stage.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+struct worker_arg {
+	struct stage *st;
+	int idx;
+};
+
+static void apply_sched(struct stage *st) {
+	int err;
+	if (st->cpus) {
+		err = pthread_setaffinity_np(pthread_self(), sizeof(*st->cpus), st->cpus);
+		if (err)
+			logln("%s: Failed to set CPU affinity: %s", st->name, strerror(err));
+	}
+
+	if (st->policy != SCHED_OTHER) {
+		struct sched_param param = { .sched_priority = st->priority };
+		err = pthread_setschedparam(pthread_self(), st->policy, &param);
+		if (err == EPERM)
+			logln("%s: Not permitted to use real-time scheduling, "
+					"running with normal priority.", st->name);
+		else if (err)
+			logln("%s: Failed to set scheduling policy: %s", st->name, strerror(err));
+	}
+}
+
+static void *worker_thread(void *arg) {
+	struct worker_arg *wa = (struct worker_arg *)arg;
+	struct stage *st = wa->st;
+	int idx = wa->idx;
+	free(wa);
+
+	apply_sched(st);
+	st->worker(st, idx);
+
+	if (atomic_fetch_sub(&st->running, 1) == 1 && st->done)
+		st->done(st);
+	return NULL;
+}
+
+void stage_start(struct stage *st) {
+	assume(st->nworkers >= 1 && st->nworkers <= STAGE_MAX_WORKERS);
+	atomic_store(&st->running, st->nworkers);
+
+	for (int i = 0; i < st->nworkers; ++i) {
+		struct worker_arg *wa = malloc(sizeof(*wa));
+		wa->st = st;
+		wa->idx = i;
+		pthread_create(&st->threads[i], NULL, worker_thread, wa);
+	}
+}
+
+void stage_join(struct stage *st) {
+	for (int i = 0; i < st->nworkers; ++i)
+		pthread_join(st->threads[i], NULL);
+}
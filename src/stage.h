@@ -0,0 +1,37 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+/*
+ * A pipeline stage: a number of threads running the same worker function,
+ * typically pulling from a shared queue. Once the last worker returns,
+ * 'done' is called, e.g to close the queues of the next stage.
+ * Users of this header need _GNU_SOURCE for cpu_set_t.
+ */
+
+#define STAGE_MAX_WORKERS 16
+
+struct stage {
+	void (*worker)(struct stage *st, int idx);
+	void (*done)(struct stage *st);
+	void *ctx;
+	int nworkers;
+
+	// Applied by each worker when it starts. If the system doesn't allow it,
+	// the worker logs a warning and runs unpinned or with normal priority.
+	const char *name;
+	const cpu_set_t *cpus; // NULL to run on any CPU
+	int policy; // SCHED_OTHER to keep the default scheduling
+	int priority;
+
+	pthread_t threads[STAGE_MAX_WORKERS];
+	atomic_int running;
+};
+
+void stage_start(struct stage *st);
+void stage_join(struct stage *st);
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pause.h"
+#include "replay.h"
+#include "time.h"
+#include "util.h"
+
+#define REQUEST_TIMEOUT_MS 100
+
+struct stats *stats_create() {
+	struct stats *s = calloc(1, sizeof(*s));
+	assume(s != NULL);
+	s->fd = -1;
+	s->start = time_now();
+	return s;
+}
+
+struct stats_output *stats_add_output(struct stats *s, const char *name) {
+	assume(s->noutputs < STATS_MAX_OUTPUTS);
+	struct stats_output *so = &s->outputs[s->noutputs++];
+	so->name = name;
+	return so;
+}
+
+static uint64_t load(_Atomic uint64_t *counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Called about once per second by the server thread
+static void update_rates(struct stats *s) {
+	double now = time_now();
+	double dt = now - s->prev_time;
+	s->prev_time = now;
+
+	uint64_t captured = load(&s->captured);
+	uint64_t converted = load(&s->converted);
+	s->cap_fps = (captured - s->prev_captured) / dt;
+	s->conv_fps = (converted - s->prev_converted) / dt;
+	s->prev_captured = captured;
+	s->prev_converted = converted;
+
+	for (int i = 0; i < s->noutputs; ++i) {
+		struct stats_output *so = &s->outputs[i];
+		uint64_t frames = load(&so->frames);
+		uint64_t bytes = load(&so->bytes);
+		so->fps = (frames - so->prev_frames) / dt;
+		so->bitrate = (bytes - so->prev_bytes) * 8 / dt;
+		so->prev_frames = frames;
+		so->prev_bytes = bytes;
+	}
+}
+
+/*
+ * Formatting
+ */
+
+// Output names are file paths; escape them for JSON strings and Prometheus labels
+static void print_escaped(FILE *f, const char *str) {
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if (*str == '\n')
+			fprintf(f, "\\n");
+		else if ((unsigned char)*str >= 0x20)
+			fputc(*str, f);
+	}
+}
+
+static const double quantiles[] = { 50, 90, 99 };
+#define NQUANTILES (sizeof(quantiles) / sizeof(*quantiles))
+
+static void print_json(struct stats *s, FILE *f) {
+	fprintf(f, "{\"uptime\":%.3f,\"paused\":%s,", time_now() - s->start,
+			pause_is_paused() ? "true" : "false");
+	fprintf(f, "\"capture\":{\"frames\":%llu,\"skipped\":%llu,\"fps\":%.2f,\"queue\":%i},",
+			(unsigned long long)load(&s->captured), (unsigned long long)load(&s->skipped),
+			s->cap_fps, s->capq ? ringbuf_used(s->capq) : 0);
+	fprintf(f, "\"convert\":{\"frames\":%llu,\"fps\":%.2f},",
+			(unsigned long long)load(&s->converted), s->conv_fps);
+
+	fprintf(f, "\"outputs\":[");
+	for (int i = 0; i < s->noutputs; ++i) {
+		struct stats_output *so = &s->outputs[i];
+		fprintf(f, "%s{\"name\":\"", i == 0 ? "" : ",");
+		print_escaped(f, so->name);
+		fprintf(f, "\",\"frames\":%llu,\"fps\":%.2f,\"packets\":%llu,\"bytes\":%llu,"
+				"\"bitrate\":%.0f,\"dropped\":%llu,\"queue\":%i",
+				(unsigned long long)load(&so->frames), so->fps,
+				(unsigned long long)load(&so->packets), (unsigned long long)load(&so->bytes),
+				so->bitrate, (unsigned long long)load(&so->dropped),
+				so->queue ? ringbuf_used(so->queue) : 0);
+
+		if (so->writer) {
+			fprintf(f, ",\"written_packets\":%llu,\"written_bytes\":%llu,\"write_queue\":%i",
+					(unsigned long long)load(&so->writer->total_packets),
+					(unsigned long long)load(&so->writer->total_bytes),
+					writer_queued(so->writer));
+		}
+
+		// Latencies in milliseconds
+		fprintf(f, ",\"latency\":{");
+		for (int st = 0; st < LATENCY_STAGES; ++st) {
+			struct histogram *h = &so->latency->stages[st];
+			fprintf(f, "%s\"%s\":{", st == 0 ? "" : ",", latency_stage_name(st));
+			for (size_t q = 0; q < NQUANTILES; ++q) {
+				fprintf(f, "\"p%.0f\":%.3f,", quantiles[q],
+						histogram_percentile(h, quantiles[q]) / 1000000.0);
+			}
+			fprintf(f, "\"max\":%.3f}", load(&h->max) / 1000000.0);
+		}
+		fprintf(f, "}}");
+	}
+	fprintf(f, "]}\n");
+}
+
+static void print_output_label(FILE *f, struct stats_output *so) {
+	fprintf(f, "output=\"");
+	print_escaped(f, so->name);
+	fprintf(f, "\"");
+}
+
+static void print_prometheus(struct stats *s, FILE *f) {
+	fprintf(f, "# TYPE xrecord_uptime_seconds gauge\n");
+	fprintf(f, "xrecord_uptime_seconds %.3f\n", time_now() - s->start);
+
+	fprintf(f, "# TYPE xrecord_paused gauge\n");
+	fprintf(f, "xrecord_paused %i\n", pause_is_paused() ? 1 : 0);
+
+	fprintf(f, "# TYPE xrecord_frames_total counter\n");
+	fprintf(f, "xrecord_frames_total{stage=\"capture\"} %llu\n",
+			(unsigned long long)load(&s->captured));
+	fprintf(f, "xrecord_frames_total{stage=\"convert\"} %llu\n",
+			(unsigned long long)load(&s->converted));
+	for (int i = 0; i < s->noutputs; ++i) {
+		fprintf(f, "xrecord_frames_total{stage=\"encode\",");
+		print_output_label(f, &s->outputs[i]);
+		fprintf(f, "} %llu\n", (unsigned long long)load(&s->outputs[i].frames));
+	}
+
+	fprintf(f, "# TYPE xrecord_fps gauge\n");
+	fprintf(f, "xrecord_fps{stage=\"capture\"} %.2f\n", s->cap_fps);
+	fprintf(f, "xrecord_fps{stage=\"convert\"} %.2f\n", s->conv_fps);
+	for (int i = 0; i < s->noutputs; ++i) {
+		fprintf(f, "xrecord_fps{stage=\"encode\",");
+		print_output_label(f, &s->outputs[i]);
+		fprintf(f, "} %.2f\n", s->outputs[i].fps);
+	}
+
+	fprintf(f, "# TYPE xrecord_skipped_frames_total counter\n");
+	fprintf(f, "xrecord_skipped_frames_total %llu\n", (unsigned long long)load(&s->skipped));
+
+	fprintf(f, "# TYPE xrecord_queue_depth gauge\n");
+	if (s->capq)
+		fprintf(f, "xrecord_queue_depth{queue=\"capture\"} %i\n", ringbuf_used(s->capq));
+	for (int i = 0; i < s->noutputs; ++i) {
+		struct stats_output *so = &s->outputs[i];
+		if (so->queue) {
+			fprintf(f, "xrecord_queue_depth{queue=\"encode\",");
+			print_output_label(f, so);
+			fprintf(f, "} %i\n", ringbuf_used(so->queue));
+		}
+		if (so->writer) {
+			fprintf(f, "xrecord_queue_depth{queue=\"write\",");
+			print_output_label(f, so);
+			fprintf(f, "} %i\n", writer_queued(so->writer));
+		}
+	}
+
+	static const struct {
+		const char *name, *type;
+		size_t offset;
+	} counters[] = {
+		{ "xrecord_packets_total", "counter", offsetof(struct stats_output, packets) },
+		{ "xrecord_encoded_bytes_total", "counter", offsetof(struct stats_output, bytes) },
+		{ "xrecord_dropped_packets_total", "counter", offsetof(struct stats_output, dropped) },
+	};
+	for (size_t c = 0; c < sizeof(counters) / sizeof(*counters); ++c) {
+		fprintf(f, "# TYPE %s %s\n", counters[c].name, counters[c].type);
+		for (int i = 0; i < s->noutputs; ++i) {
+			struct stats_output *so = &s->outputs[i];
+			fprintf(f, "%s{", counters[c].name);
+			print_output_label(f, so);
+			fprintf(f, "} %llu\n", (unsigned long long)load(
+						(_Atomic uint64_t *)((char *)so + counters[c].offset)));
+		}
+	}
+
+	fprintf(f, "# TYPE xrecord_written_bytes_total counter\n");
+	for (int i = 0; i < s->noutputs; ++i) {
+		struct stats_output *so = &s->outputs[i];
+		if (!so->writer)
+			continue;
+		fprintf(f, "xrecord_written_bytes_total{");
+		print_output_label(f, so);
+		fprintf(f, "} %llu\n", (unsigned long long)load(&so->writer->total_bytes));
+	}
+
+	fprintf(f, "# TYPE xrecord_bitrate_bps gauge\n");
+	for (int i = 0; i < s->noutputs; ++i) {
+		fprintf(f, "xrecord_bitrate_bps{");
+		print_output_label(f, &s->outputs[i]);
+		fprintf(f, "} %.0f\n", s->outputs[i].bitrate);
+	}
+
+	fprintf(f, "# TYPE xrecord_latency_seconds summary\n");
+	for (int i = 0; i < s->noutputs; ++i) {
+		struct stats_output *so = &s->outputs[i];
+		for (int st = 0; st < LATENCY_STAGES; ++st) {
+			struct histogram *h = &so->latency->stages[st];
+			for (size_t q = 0; q < NQUANTILES; ++q) {
+				fprintf(f, "xrecord_latency_seconds{stage=\"%s\",quantile=\"%g\",",
+						latency_stage_name(st), quantiles[q] / 100);
+				print_output_label(f, so);
+				fprintf(f, "} %.6f\n", histogram_percentile(h, quantiles[q]) / 1e9);
+			}
+			fprintf(f, "xrecord_latency_seconds_count{stage=\"%s\",", latency_stage_name(st));
+			print_output_label(f, so);
+			fprintf(f, "} %llu\n", (unsigned long long)load(&h->count));
+		}
+	}
+}
+
+void stats_report(struct stats *s, double seconds) {
+	logln("Ran for %.2fs:", seconds);
+	logln("  capture: %llu frames, %.2f fps, %llu skipped",
+			(unsigned long long)load(&s->captured), load(&s->captured) / seconds,
+			(unsigned long long)load(&s->skipped));
+	logln("  convert: %llu frames, %.2f fps",
+			(unsigned long long)load(&s->converted), load(&s->converted) / seconds);
+	for (int i = 0; i < s->noutputs; ++i) {
+		struct stats_output *so = &s->outputs[i];
+		logln("  %s: %llu frames, %.2f fps, %llu packets, %.0f kbit/s",
+				so->name, (unsigned long long)load(&so->frames), load(&so->frames) / seconds,
+				(unsigned long long)load(&so->packets), load(&so->bytes) * 8 / seconds / 1000);
+	}
+}
+
+/*
+ * Server
+ */
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void serve_client(struct stats *s, int fd) {
+	// Clients which don't send anything get JSON
+	char req[256] = "";
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) > 0) {
+		ssize_t n = read(fd, req, sizeof(req) - 1);
+		req[n > 0 ? n : 0] = '\0';
+	}
+
+	char *eol = strpbrk(req, "\r\n");
+	if (eol)
+		*eol = '\0';
+
+	// Requests to pause, resume or dump get the stats back like any other
+	if (strstr(req, "resume"))
+		pause_set(false);
+	else if (strstr(req, "pause"))
+		pause_set(true);
+	if (strstr(req, "dump"))
+		replay_request_dump();
+
+	bool http = strncmp(req, "GET ", 4) == 0;
+	bool prometheus = strstr(req, "prometheus") || strstr(req, "metrics");
+
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL)
+		return;
+
+	if (prometheus)
+		print_prometheus(s, f);
+	else
+		print_json(s, f);
+	fclose(f);
+
+	if (http) {
+		char header[256];
+		int hlen = snprintf(header, sizeof(header),
+				"HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+				prometheus ? "text/plain; version=0.0.4" : "application/json", len);
+		if (write_all(fd, header, hlen) < 0) {
+			free(buf);
+			return;
+		}
+	}
+
+	// Responses fit in the socket buffer; a client which hasn't made room
+	// for one by now is dropped, rather than holding up the server
+	if (write_all(fd, buf, len) < 0 && errno == EAGAIN)
+		logln("stats: Client isn't reading, dropping it.");
+	free(buf);
+}
+
+static void *server_thread(void *arg) {
+	struct stats *s = (struct stats *)arg;
+
+	s->prev_time = time_now();
+	double nextsec = s->prev_time + 1;
+	while (1) {
+		int timeout = (nextsec - time_now()) * 1000;
+		struct pollfd fds[2] = {
+			{ .fd = s->fd, .events = POLLIN },
+			{ .fd = s->stopfd[0], .events = POLLIN },
+		};
+
+		int ret = poll(fds, 2, timeout > 0 ? timeout : 0);
+		if (ret < 0 && errno != EINTR)
+			ppanic("poll");
+		if (fds[1].revents)
+			break;
+
+		if (time_now() >= nextsec) {
+			update_rates(s);
+			nextsec += 1;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (fd < 0) {
+				logperror("stats: accept");
+				continue;
+			}
+
+			serve_client(s, fd);
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+int stats_listen(struct stats *s, const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logln("%s: Socket path too long.", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s->fd < 0) {
+		logperror("socket");
+		return -1;
+	}
+
+	// Replace a socket left behind by an earlier run
+	unlink(path);
+	if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s->fd, 8) < 0) {
+		logperror("%s", path);
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	if (pipe2(s->stopfd, O_CLOEXEC) < 0) {
+		logperror("pipe");
+		close(s->fd);
+		s->fd = -1;
+		unlink(path);
+		return -1;
+	}
+
+	s->path = strdup(path);
+	pthread_create(&s->thread, NULL, server_thread, s);
+	logln("Serving stats on %s.", path);
+	return 0;
+}
+
+void stats_free(struct stats *s) {
+	if (s->fd >= 0) {
+		write_all(s->stopfd[1], "", 1);
+		pthread_join(s->thread, NULL);
+		close(s->stopfd[0]);
+		close(s->stopfd[1]);
+		close(s->fd);
+		unlink(s->path);
+		free(s->path);
+	}
+
+	free(s);
+}
@@ -0,0 +1,80 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "latency.h"
+#include "ringbuf.h"
+#include "writer.h"
+
+/*
+ * Pipeline counters, optionally served on a Unix socket.
+ * The pipeline only does relaxed atomic increments and the server only reads,
+ * so scraping never takes a lock the pipeline waits on.
+ *
+ * Clients send a line with "json" or "prometheus", or an HTTP GET
+ * (e.g curl --unix-socket <path> http://localhost/metrics, where any
+ * path containing "metrics" gives Prometheus text), and get one response.
+ * A line or path containing "pause" or "resume" also pauses or resumes
+ * the recording first, and one containing "dump" dumps the replay buffers
+ * like SIGUSR1.
+ */
+
+#define STATS_MAX_OUTPUTS 8
+
+struct stats_output {
+	const char *name;
+	struct latency *latency;
+	struct ringbuf *queue;
+	struct writer *writer; // NULL when the output doesn't write to a file
+
+	_Atomic uint64_t frames; // Sent to the encoder
+	_Atomic uint64_t packets; // Out of the encoder
+	_Atomic uint64_t bytes; // Out of the encoder
+	_Atomic uint64_t dropped; // Packets discarded instead of written
+
+	// Rates over the last second; only touched by the server thread
+	uint64_t prev_frames, prev_bytes;
+	double fps, bitrate;
+};
+
+struct stats {
+	_Atomic uint64_t captured;
+	_Atomic uint64_t skipped; // Frames not captured because capture fell behind
+	_Atomic uint64_t converted;
+	struct ringbuf *capq;
+
+	int noutputs;
+	struct stats_output outputs[STATS_MAX_OUTPUTS];
+
+	// Server
+	char *path;
+	int fd;
+	int stopfd[2];
+	pthread_t thread;
+	double start;
+	double prev_time;
+	uint64_t prev_captured, prev_converted;
+	double cap_fps, conv_fps;
+};
+
+struct stats *stats_create();
+
+struct stats_output *stats_add_output(struct stats *s, const char *name);
+
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t n) {
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// Log a summary of the frame counts and average rates over 'seconds'.
+void stats_report(struct stats *s, double seconds);
+
+// Start serving the stats on a Unix socket at 'path'.
+int stats_listen(struct stats *s, const char *path);
+
+// Stop the server, if any, and free the stats.
+void stats_free(struct stats *s);
+
+#endif
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include "stream.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "time.h"
+
+#define POLL_INTERVAL_MS 100
+#define CLOSE_TIMEOUT 1.0 // Seconds
+
+// More than the container adds to a packet, so that a packet which fits
+// before it's muxed still fits afterwards
+#define MUX_OVERHEAD(size) ((size) / 8 + 64 * 1024)
+
+// The muxer's output for a packet goes to staging first,
+// so that it can be dropped as a whole if the backlog is full
+static int stage_data(void *opaque, const uint8_t *buf, int len) {
+	struct stream *s = opaque;
+	if (s->staginglen + len > s->stagingcap) {
+		while (s->staginglen + len > s->stagingcap)
+			s->stagingcap = s->stagingcap ? s->stagingcap * 2 : 64 * 1024;
+		s->staging = realloc(s->staging, s->stagingcap);
+		if (s->staging == NULL)
+			panic("Failed to allocate stream staging buffer.");
+	}
+
+	memcpy(s->staging + s->staginglen, buf, len);
+	s->staginglen += len;
+	return len;
+}
+
+// Whether a packet of 'size' bytes will fit in the backlog once it's muxed
+static bool has_room(struct stream *s, size_t size) {
+	pthread_mutex_lock(&s->mut);
+	bool ok = !s->failed && (s->len == 0 || s->len + size + MUX_OVERHEAD(size) <= s->budget);
+	pthread_mutex_unlock(&s->mut);
+	return ok;
+}
+
+// Move the staged data into the backlog. If there's no room for it, either
+// wait for the reader, or if 'wait' is false, drop it.
+static bool commit(struct stream *s, bool wait) {
+	pthread_mutex_lock(&s->mut);
+
+	// Once muxed, data can't be dropped without breaking the container,
+	// and has_room leaves enough margin that this is rare
+	while (wait && !s->failed && s->len > 0 && s->len + s->staginglen > s->budget)
+		pthread_cond_wait(&s->cond, &s->mut);
+
+	// An empty backlog always accepts the data, no matter how large
+	if (s->len == 0 && s->staginglen > s->budget) {
+		free(s->backlog);
+		s->budget = s->staginglen;
+		s->start = 0;
+		s->backlog = malloc(s->budget);
+		if (s->backlog == NULL)
+			panic("Failed to allocate stream backlog.");
+	}
+
+	bool ok = !s->failed && s->len + s->staginglen <= s->budget;
+	if (ok) {
+		size_t end = (s->start + s->len) % s->budget;
+		size_t n = s->budget - end;
+		if (n > s->staginglen)
+			n = s->staginglen;
+		memcpy(s->backlog + end, s->staging, n);
+		memcpy(s->backlog, s->staging + n, s->staginglen - n);
+		s->len += s->staginglen;
+		pthread_cond_signal(&s->cond);
+	}
+
+	pthread_mutex_unlock(&s->mut);
+	s->staginglen = 0;
+	return ok;
+}
+
+// Returns the number of bytes written, 0 if the reader isn't ready, or -1
+static ssize_t write_some(struct stream *s, const unsigned char *data, size_t len) {
+	// When poll says a pipe is writable, it has room for PIPE_BUF bytes,
+	// so a write that small won't block even if the descriptor does
+	if (s->blocking && len > PIPE_BUF)
+		len = PIPE_BUF;
+
+	struct pollfd pfd = { .fd = s->fd, .events = POLLOUT };
+	int ret = poll(&pfd, 1, POLL_INTERVAL_MS);
+	if (ret < 0 && errno != EINTR) {
+		logperror("%s: poll", s->path);
+		return -1;
+	} else if (ret <= 0) {
+		return 0;
+	}
+
+	ssize_t n = write(s->fd, data, len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	else if (n < 0)
+		logperror("%s", s->path);
+	return n;
+}
+
+static void *stream_thread(void *arg) {
+	struct stream *s = arg;
+	double deadline = 0;
+
+	pthread_mutex_lock(&s->mut);
+	while (1) {
+		while (s->len == 0 && !s->closed)
+			pthread_cond_wait(&s->cond, &s->mut);
+		if (s->len == 0)
+			break;
+
+		if (s->closed && deadline == 0) {
+			deadline = time_now() + CLOSE_TIMEOUT;
+		} else if (s->closed && time_now() > deadline) {
+			logln("%s: Reader too slow, dropping %zu bytes at close.", s->path, s->len);
+			break;
+		}
+
+		// Only this thread removes data, and the pusher only
+		// reallocates the backlog when it's empty, so this stays valid
+		size_t n = s->len;
+		if (s->start + n > s->budget)
+			n = s->budget - s->start;
+		const unsigned char *data = s->backlog + s->start;
+		pthread_mutex_unlock(&s->mut);
+
+		ssize_t written = write_some(s, data, n);
+
+		pthread_mutex_lock(&s->mut);
+		if (written < 0) {
+			logln("%s: Reader went away, dropping the rest of the stream.", s->path);
+			s->failed = true;
+			s->len = 0;
+		} else {
+			s->start = (s->start + written) % s->budget;
+			s->len -= written;
+		}
+
+		// The pusher may be waiting for room
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->mut);
+
+	return NULL;
+}
+
+static bool is_socket_or_fifo(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode));
+}
+
+bool stream_is_target(const char *path) {
+	return
+		strcmp(path, "-") == 0 ||
+		strncmp(path, "unix:", 5) == 0 ||
+		is_socket_or_fifo(path);
+}
+
+static int connect_socket(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logln("%s: Socket path too long.", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		logperror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		logperror("%s", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int open_target(const char *path) {
+	int fd;
+	struct stat st;
+	if (strcmp(path, "-") == 0) {
+		fd = dup(STDOUT_FILENO);
+		if (fd < 0)
+			logperror("stdout");
+	} else if (strncmp(path, "unix:", 5) == 0) {
+		fd = connect_socket(path + 5);
+	} else if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		fd = connect_socket(path);
+	} else {
+		// Opening a FIFO blocks until there's a reader
+		logln("%s: Waiting for a reader...", path);
+		fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			logperror("%s", path);
+	}
+
+	if (fd < 0)
+		return -1;
+
+	// Stdout's file description is shared with the shell and whoever else
+	// writes to it, which would all see the flag, even after we've exited
+	if (strcmp(path, "-") == 0)
+		return fd;
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		logperror("%s: fcntl", path);
+
+	return fd;
+}
+
+struct stream *stream_create(
+		struct muxconf *conf, AVCodecContext *avctx, size_t budget,
+		struct latency *latency, _Atomic uint64_t *dropped) {
+	int fd = open_target(conf->path);
+	if (fd < 0)
+		return NULL;
+
+	// A reader going away should end the stream, not the recording
+	signal(SIGPIPE, SIG_IGN);
+
+	struct stream *s = malloc(sizeof(*s));
+	s->latency = latency;
+	s->dropped = dropped;
+	s->path = strdup(conf->path);
+	s->fd = fd;
+	s->blocking = !(fcntl(fd, F_GETFL) & O_NONBLOCK);
+	s->staging = NULL;
+	s->staginglen = 0;
+	s->stagingcap = 0;
+	s->dropping = false;
+	pthread_mutex_init(&s->mut, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->backlog = malloc(budget);
+	if (s->backlog == NULL)
+		panic("Failed to allocate stream backlog.");
+	s->budget = budget;
+	s->start = 0;
+	s->len = 0;
+	s->closed = false;
+	s->failed = false;
+
+	s->mux = mux_create_stream(conf, s, stage_data);
+	if (s->mux == NULL || mux_start(s->mux, avctx) < 0)
+		panic("Failed to start muxer for %s.", conf->path);
+	commit(s, false);
+
+	pthread_create(&s->thread, NULL, stream_thread, s);
+	return s;
+}
+
+void stream_push(struct stream *s, AVPacket *pkt) {
+	// Resume at a keyframe; anything before that would refer to dropped frames
+	if (s->dropping && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+		atomic_fetch_add_explicit(s->dropped, 1, memory_order_relaxed);
+		av_packet_unref(pkt);
+		return;
+	}
+
+	// The muxer consumes the packet, so keep a copy of its timestamps
+	struct frameinfo *fi = frameinfo_get(pkt->opaque_ref);
+	struct frameinfo info;
+	bool has_info = fi != NULL;
+	if (has_info)
+		info = *fi;
+
+	// Decide before muxing, so that the muxer never counts a dropped packet
+	s->dropping = !has_room(s, pkt->size);
+	if (s->dropping) {
+		atomic_fetch_add_explicit(s->dropped, 1, memory_order_relaxed);
+		av_packet_unref(pkt);
+		return;
+	}
+
+	if (mux_write(s->mux, pkt) < 0)
+		panic("Failed to mux packet for %s.", s->path);
+
+	// Only fails if the reader went away
+	if (!commit(s, true)) {
+		atomic_fetch_add_explicit(s->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	// The backlog is normally empty, so this is about when the reader gets it
+	if (has_info && s->latency)
+		latency_record(s->latency, &info, time_now_ns());
+}
+
+void stream_free(struct stream *s) {
+	// The stream ends here, so the trailer isn't worth waiting for
+	mux_free(s->mux);
+	commit(s, false);
+
+	pthread_mutex_lock(&s->mut);
+	s->closed = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->mut);
+
+	pthread_join(s->thread, NULL);
+	close(s->fd);
+
+	pthread_mutex_destroy(&s->mut);
+	pthread_cond_destroy(&s->cond);
+	free(s->backlog);
+	free(s->staging);
+	free(s->path);
+	free(s);
+}
@@ -0,0 +1,69 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+#include "mux.h"
+#include "latency.h"
+
+/*
+ * Live output to stdout ("-"), a FIFO, or a Unix socket
+ * ("unix:<path>", or the path of a socket which already exists).
+ *
+ * Packets are muxed on the encoder's thread into a bounded backlog,
+ * which the stream's thread writes out with non-blocking I/O (for stdout,
+ * writes small enough not to block once polled), so a slow reader never
+ * stalls the encoder. When the backlog is full, packets are
+ * dropped until the next keyframe, so that the reader never gets a frame
+ * which refers to one it didn't get. Packets are dropped before they
+ * reach the muxer, so the container stays consistent.
+ */
+
+struct stream {
+	struct mux *mux;
+	struct latency *latency;
+	_Atomic uint64_t *dropped;
+	char *path;
+	int fd;
+	bool blocking; // Stdout, which we leave blocking
+	pthread_t thread;
+
+	// Muxed data for the packet being pushed; only touched by the pusher
+	unsigned char *staging;
+	size_t staginglen;
+	size_t stagingcap;
+	bool dropping;
+
+	pthread_mutex_t mut;
+	pthread_cond_t cond;
+
+	// Ring of muxed data not yet written
+	unsigned char *backlog;
+	size_t budget;
+	size_t start;
+	size_t len;
+
+	bool closed;
+	bool failed; // The reader went away; everything is dropped
+};
+
+// Whether 'path' should be streamed to rather than written as a file.
+bool stream_is_target(const char *path);
+
+// Opens the target, which for a FIFO waits for a reader, and writes the header.
+// Dropped packets are counted in 'dropped', and written packets'
+// latencies recorded in 'latency'.
+struct stream *stream_create(
+		struct muxconf *conf, AVCodecContext *avctx, size_t budget,
+		struct latency *latency, _Atomic uint64_t *dropped);
+
+// Mux a packet, taking ownership of its reference. Never blocks on the reader.
+void stream_push(struct stream *s, AVPacket *pkt);
+
+// Write the trailer and whatever the reader accepts within a second, then close.
+void stream_free(struct stream *s);
+
+#endif
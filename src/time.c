@@ -10,6 +10,12 @@ double time_now() {
 	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
 }
 
+uint64_t time_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 void time_print(double t, FILE *f) {
 	if (t < 0.001)
 		fprintf(f, "%.3fµs", t * 1000000.0);
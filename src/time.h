@@ -2,8 +2,10 @@
 #define TIME_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 double time_now();
+uint64_t time_now_ns();
 void time_print(double t, FILE *f);
 
 void _time_done(const char *desc, double t);
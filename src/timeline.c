@@ -1,34 +1,229 @@
 #include "timeline.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "time.h"
+#include "util.h"
+
+#define MAX_NAMES 64
+#define RING_SIZE 4096 // Events; must be a power of two
+#define DRAIN_INTERVAL_NS 10000000
+
+struct tlevent {
+	uint64_t time;
+	int64_t frame;
+	uint32_t name;
+	uint16_t thread;
+	uint8_t kind;
+	uint8_t pad;
+};
+
+// Single producer (the owning thread), single consumer (the drain thread)
+struct tlring {
+	struct tlring *next;
+	uint16_t thread;
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	_Atomic uint64_t dropped;
+	struct tlevent events[RING_SIZE];
+};
 
-static pthread_mutex_t mut;
 static FILE *file = NULL;
+static pthread_t drain_th;
+static atomic_bool running;
+
+// Interned names, by the caller's pointer, so that looking one up doesn't
+// compare strings. Entries are never removed, so lookups don't need the lock.
+static pthread_mutex_t names_mut = PTHREAD_MUTEX_INITIALIZER;
+static const char *names[MAX_NAMES];
+static atomic_int nnames;
+
+// All threads' rings; only ever appended to
+static pthread_mutex_t rings_mut = PTHREAD_MUTEX_INITIALIZER;
+static struct tlring *_Atomic rings = NULL;
+static uint16_t nthreads = 0;
+
+static __thread struct tlring *ring = NULL;
+static __thread int64_t curframe = -1;
+
+static int lookup(const char *name) {
+	int n = atomic_load_explicit(&nnames, memory_order_acquire);
+	for (int i = 0; i < n; ++i) {
+		if (names[i] == name)
+			return i;
+	}
+
+	return -1;
+}
+
+static int intern(const char *name) {
+	int id = lookup(name);
+	if (id >= 0)
+		return id;
+
+	pthread_mutex_lock(&names_mut);
+	id = lookup(name);
+	if (id < 0) {
+		id = atomic_load(&nnames);
+		if (id == MAX_NAMES)
+			panic("Too many timeline names");
+		names[id] = name;
+		atomic_store_explicit(&nnames, id + 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&names_mut);
+	return id;
+}
+
+static struct tlring *thread_ring() {
+	if (ring != NULL)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	assume(ring != NULL);
+
+	pthread_mutex_lock(&rings_mut);
+	ring->thread = nthreads++;
+	ring->next = atomic_load(&rings);
+	atomic_store_explicit(&rings, ring, memory_order_release);
+	pthread_mutex_unlock(&rings_mut);
+	return ring;
+}
+
+static void push(uint8_t kind, const char *name, uint64_t time) {
+	struct tlring *r = thread_ring();
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	// Never stall the caller; the drain thread reports what's lost
+	if (head - tail == RING_SIZE) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	struct tlevent *ev = &r->events[head & (RING_SIZE - 1)];
+	ev->time = time;
+	ev->frame = curframe;
+	ev->name = intern(name);
+	ev->thread = r->thread;
+	ev->kind = kind;
+	ev->pad = 0;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Drain thread
+ */
+
+static int written_names = 0;
+
+static void write_names() {
+	int n = atomic_load_explicit(&nnames, memory_order_acquire);
+	for (; written_names < n; ++written_names) {
+		size_t len = strlen(names[written_names]);
+		struct tlevent ev = {
+			.time = time_now_ns(),
+			.frame = len,
+			.name = written_names,
+			.kind = TIMELINE_NAME,
+		};
+		fwrite(&ev, sizeof(ev), 1, file);
+		fwrite(names[written_names], 1, len, file);
+	}
+}
+
+static void drain() {
+	// Names are interned before the events which use them are published
+	write_names();
+
+	struct tlring *r = atomic_load_explicit(&rings, memory_order_acquire);
+	for (; r != NULL; r = r->next) {
+		uint64_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+		if (dropped > 0) {
+			struct tlevent ev = {
+				.time = time_now_ns(),
+				.frame = dropped,
+				.thread = r->thread,
+				.kind = TIMELINE_DROPPED,
+			};
+			fwrite(&ev, sizeof(ev), 1, file);
+		}
+
+		uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		while (tail != head) {
+			// Write contiguous runs straight out of the ring
+			size_t start = tail & (RING_SIZE - 1);
+			size_t count = head - tail;
+			if (start + count > RING_SIZE)
+				count = RING_SIZE - start;
+
+			fwrite(&r->events[start], sizeof(struct tlevent), count, file);
+			tail += count;
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+}
+
+static void *drain_thread(void *arg) {
+	struct timespec interval = { 0, DRAIN_INTERVAL_NS };
+	while (atomic_load(&running)) {
+		nanosleep(&interval, NULL);
+		drain();
+	}
+
+	return NULL;
+}
 
 void timeline_init(FILE *f) {
+	static const char magic[8] = { 'X', 'R', 'T', 'L', 0, 0, 0, 1 };
 	file = f;
-	pthread_mutex_init(&mut, NULL);
+	fwrite(magic, 1, sizeof(magic), file);
+
+	atomic_store(&running, true);
+	pthread_create(&drain_th, NULL, drain_thread, NULL);
+}
+
+bool timeline_enabled() {
+	return file != NULL;
 }
 
 void timeline_register(char *name) {
 	if (file == NULL) return;
-	pthread_mutex_lock(&mut);
-	fprintf(file, "%s: REGISTER: %f\n", name, time_now());
-	pthread_mutex_unlock(&mut);
+	intern(name);
+}
+
+void timeline_frame(int64_t frame) {
+	curframe = frame;
 }
 
 void timeline_begin(char *name) {
 	if (file == NULL) return;
-	pthread_mutex_lock(&mut);
-	fprintf(file, "%s: BEGIN: %f\n", name, time_now());
-	pthread_mutex_unlock(&mut);
+	push(TIMELINE_BEGIN, name, time_now_ns());
 }
 
 void timeline_end(char *name) {
 	if (file == NULL) return;
-	pthread_mutex_lock(&mut);
-	fprintf(file, "%s: END: %f\n", name, time_now());
-	pthread_mutex_unlock(&mut);
+	push(TIMELINE_END, name, time_now_ns());
+}
+
+void timeline_span(char *name, uint64_t start, uint64_t end) {
+	if (file == NULL) return;
+	push(TIMELINE_BEGIN, name, start);
+	push(TIMELINE_END, name, end);
+}
+
+void timeline_close() {
+	if (file == NULL) return;
+
+	atomic_store(&running, false);
+	pthread_join(drain_th, NULL);
+	drain();
+
+	fclose(file);
+	file = NULL;
 }
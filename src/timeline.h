@@ -2,15 +2,52 @@
 #define TIMELINE_H
 
 /*
- * This timeline system just produces a file which logs some info.
- * It must be parsed by some tool to be useful.
+ * This timeline system produces a binary file of begin/end events.
+ * Every thread appends to its own ring without locking, and a background
+ * thread drains the rings to the file. tools/timeline.py converts the file
+ * to Chrome trace-event JSON, which Perfetto and chrome://tracing can open.
+ *
+ * The file starts with the 8 byte magic "XRTL\0\0\0\1", followed by
+ * 24 byte little-endian records:
+ *
+ *   u64 time (CLOCK_MONOTONIC nanoseconds)
+ *   i64 frame id, or -1; for NAME records, the length of the name
+ *   u32 name id
+ *   u16 thread id
+ *   u8  kind (enum timeline_kind)
+ *   u8  padding
+ *
+ * NAME records are followed by the name's bytes, and come before
+ * any event which uses the name id. Names are told apart by their pointer,
+ * so the same string may get several ids.
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum timeline_kind {
+	TIMELINE_NAME = 0,
+	TIMELINE_BEGIN = 1,
+	TIMELINE_END = 2,
+	TIMELINE_DROPPED = 3, // 'frame' is the number of events lost to a full ring
+};
 
 void timeline_init(FILE *f);
+bool timeline_enabled();
+// Names are kept by pointer, and must stay valid until timeline_close.
 void timeline_register(char *name);
+
+// Set the frame id which this thread's following events are tagged with.
+void timeline_frame(int64_t frame);
+
 void timeline_begin(char *name);
 void timeline_end(char *name);
 
+// Add a span which has already happened, with times from time_now_ns().
+void timeline_span(char *name, uint64_t start, uint64_t end);
+
+// Drain what's left, stop the background thread and close the file.
+void timeline_close();
+
 #endif
@@ -0,0 +1,191 @@
+#include "transcode.h"
+
+#include <libavutil/pixdesc.h>
+
+#include "util.h"
+
+struct transcoder {
+	AVFormatContext *inctx;
+	AVStream *instream;
+	AVCodecContext *dec;
+	AVCodecContext *enc;
+	struct mux *mux;
+	AVFrame *frame;
+	AVPacket *pkt;
+	int64_t frames;
+	int64_t next_pts;
+};
+
+// Drain the encoder into the muxer
+static int write_packets(struct transcoder *t) {
+	while (1) {
+		int ret = avcodec_receive_packet(t->enc, t->pkt);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 0;
+		if (ret < 0)
+			return ret;
+
+		t->pkt->stream_index = 0;
+		if ((ret = mux_write(t->mux, t->pkt)) < 0)
+			return ret;
+	}
+}
+
+// Drain the decoder into the encoder
+static int encode_frames(struct transcoder *t) {
+	while (1) {
+		int ret = avcodec_receive_frame(t->dec, t->frame);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 0;
+		if (ret < 0)
+			return ret;
+
+		// The encoder's time base comes from the rounded average frame rate,
+		// so variable rate input can map two frames to the same timestamp;
+		// like the recorder, only keep timestamps increasing
+		int64_t ts = t->frame->best_effort_timestamp;
+		t->frame->pts = t->next_pts;
+		if (ts != AV_NOPTS_VALUE) {
+			int64_t pts = av_rescale_q(ts, t->instream->time_base, t->enc->time_base);
+			if (pts > t->frame->pts)
+				t->frame->pts = pts;
+		}
+		t->next_pts = t->frame->pts + 1;
+		t->frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+		ret = avcodec_send_frame(t->enc, t->frame);
+		av_frame_unref(t->frame);
+		if (ret < 0)
+			return ret;
+
+		t->frames += 1;
+		if ((ret = write_packets(t)) < 0)
+			return ret;
+	}
+}
+
+static int open_input(struct transcoder *t, const char *inpath) {
+	int ret;
+	if ((ret = avformat_open_input(&t->inctx, inpath, NULL, NULL)) < 0) {
+		logln("%s: %s", inpath, av_err2str(ret));
+		return ret;
+	}
+
+	if ((ret = avformat_find_stream_info(t->inctx, NULL)) < 0) {
+		logln("%s: Failed to read stream info: %s", inpath, av_err2str(ret));
+		return ret;
+	}
+
+	const AVCodec *codec;
+	int idx = av_find_best_stream(t->inctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+	if (idx < 0) {
+		logln("%s: No video stream.", inpath);
+		return idx;
+	}
+
+	t->instream = t->inctx->streams[idx];
+	t->dec = avcodec_alloc_context3(codec);
+	avcodec_parameters_to_context(t->dec, t->instream->codecpar);
+	t->dec->thread_count = 0;
+
+	if ((ret = avcodec_open2(t->dec, codec, NULL)) < 0) {
+		logln("%s: Failed to open decoder %s: %s", inpath, codec->name, av_err2str(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static int run(
+		struct transcoder *t, const char *inpath, struct muxconf *muxconf,
+		const char *encoder, struct encconf *encconf) {
+	int ret;
+	if ((ret = open_input(t, inpath)) < 0)
+		return ret;
+
+	AVRational fps = t->instream->avg_frame_rate;
+	if (fps.num <= 0 || fps.den <= 0)
+		fps = t->instream->r_frame_rate;
+
+	encconf->width = t->dec->width;
+	encconf->height = t->dec->height;
+	encconf->fps = (int)(av_q2d(fps) + 0.5);
+	encconf->pix_fmt = av_get_pix_fmt_name(t->dec->pix_fmt);
+	encconf->global_header = mux_needs_global_header(muxconf);
+	if (encconf->fps <= 0) {
+		logln("%s: Unknown frame rate.", inpath);
+		return -1;
+	}
+
+	logln("Transcoding %s (%s %ix%i@%i) to %s.",
+			inpath, t->dec->codec->name, encconf->width, encconf->height,
+			encconf->fps, muxconf->path);
+
+	const AVCodec *codec;
+	if ((ret = open_encoder(&codec, &t->enc, encoder, encconf)) < 0) {
+		logln("Failed to open encoder.");
+		return ret;
+	}
+
+	// Frames are fed from system memory
+	if (t->enc->hw_frames_ctx) {
+		logln("Encoder %s needs hardware frames; pick a different one with --encoder.",
+				codec->name);
+		return -1;
+	}
+
+	t->mux = mux_create(muxconf);
+	if (t->mux == NULL)
+		return -1;
+	if ((ret = mux_start(t->mux, t->enc)) < 0)
+		return ret;
+
+	t->frame = av_frame_alloc();
+	t->pkt = av_packet_alloc();
+
+	AVPacket *inpkt = av_packet_alloc();
+	while ((ret = av_read_frame(t->inctx, inpkt)) >= 0) {
+		if (inpkt->stream_index == t->instream->index) {
+			ret = avcodec_send_packet(t->dec, inpkt);
+			if (ret >= 0)
+				ret = encode_frames(t);
+		}
+
+		av_packet_unref(inpkt);
+		if (ret < 0)
+			break;
+	}
+	av_packet_free(&inpkt);
+
+	if (ret < 0 && ret != AVERROR_EOF) {
+		logln("%s: Transcoding failed: %s", inpath, av_err2str(ret));
+		return ret;
+	}
+
+	// Flush the decoder, then the encoder
+	avcodec_send_packet(t->dec, NULL);
+	if ((ret = encode_frames(t)) < 0)
+		return ret;
+	avcodec_send_frame(t->enc, NULL);
+	if ((ret = write_packets(t)) < 0)
+		return ret;
+
+	logln("Transcoded %lli frames.", (long long)t->frames);
+	return 0;
+}
+
+int transcode(
+		const char *inpath, struct muxconf *muxconf,
+		const char *encoder, struct encconf *encconf) {
+	struct transcoder t = { 0 };
+	int ret = run(&t, inpath, muxconf, encoder, encconf);
+
+	if (t.mux)
+		mux_free(t.mux);
+	av_packet_free(&t.pkt);
+	av_frame_free(&t.frame);
+	avcodec_free_context(&t.enc);
+	avcodec_free_context(&t.dec);
+	avformat_close_input(&t.inctx);
+	return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include "mux.h"
+#include "venc.h"
+
+// Decode the video stream in 'inpath' (typically a lossless intermediate)
+// and re-encode it to the output described by 'muxconf'.
+// The size, frame rate and pixel format in 'encconf' are taken from the input.
+int transcode(
+		const char *inpath, struct muxconf *muxconf,
+		const char *encoder, struct encconf *encconf);
+
+#endif
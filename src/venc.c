@@ -1,16 +1,188 @@
 #include "venc.h"
 
 #include <libavutil/hwcontext.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <fnmatch.h>
 #include <stdbool.h>
 
+#include "probecache.h"
 #include "util.h"
 
+/*
+ * Tuning profiles. Options apply to codecs whose name matches the pattern;
+ * options which a codec doesn't know are reported and ignored.
+ */
+
+struct encopt {
+	const char *codecs;
+	const char *key;
+	const char *value;
+};
+
+struct encprofile {
+	const char *name;
+
+	// Keyframe interval, in seconds of video; 0 means intra-only
+	int gop_seconds;
+
+	struct encopt opts[12];
+};
+
+static const struct encprofile profiles[] = {
+	// Lowest latency and CPU use: no B-frames or lookahead, slice threads
+	{ "realtime", 2, {
+		{ "*", "bf", "0" },
+		{ "*", "thread_type", "slice" },
+		{ "libx264", "preset", "superfast" },
+		{ "libx264", "tune", "zerolatency" },
+		{ "libx264", "crf", "23" },
+		{ "*nvenc*", "preset", "p1" },
+		{ "*nvenc*", "tune", "ull" },
+		{ "*nvenc*", "zerolatency", "1" },
+		{ NULL },
+	} },
+
+	// For live streams: like realtime, but nothing is held back,
+	// and intra refresh spreads keyframes' bits over many frames
+	// so that no single frame takes long to send
+	{ "lowlatency", 1, {
+		{ "*", "bf", "0" },
+		{ "*", "thread_type", "slice" },
+		{ "libx264", "preset", "superfast" },
+		{ "libx264", "tune", "zerolatency" },
+		{ "libx264", "intra-refresh", "1" },
+		{ "libx264", "crf", "23" },
+		{ "*nvenc*", "preset", "p1" },
+		{ "*nvenc*", "tune", "ull" },
+		{ "*nvenc*", "zerolatency", "1" },
+		{ "*nvenc*", "delay", "0" },
+		{ "*nvenc*", "intra-refresh", "1" },
+		{ NULL },
+	} },
+
+	{ "balanced", 5, {
+		{ "*", "bf", "2" },
+		{ "libx264", "preset", "veryfast" },
+		{ "libx264", "crf", "23" },
+		{ "*nvenc*", "preset", "p4" },
+		{ "*nvenc*", "tune", "ll" },
+		{ NULL },
+	} },
+
+	// Best compression, for recordings which are kept
+	{ "archival", 10, {
+		{ "*", "bf", "3" },
+		{ "libx264", "preset", "slow" },
+		{ "libx264", "crf", "18" },
+		{ "*nvenc*", "preset", "p7" },
+		{ "*nvenc*", "tune", "hq" },
+		{ NULL },
+	} },
+
+	// Cheap intra-only lossless intermediate, meant for ffv1 or utvideo;
+	// transcode it afterwards. Every frame is split into slices
+	// which are compressed on separate threads.
+	{ "lossless", 0, {
+		{ "*", "threads", "auto" },
+		{ "*", "thread_type", "slice" },
+		{ "ffv1", "level", "3" },
+		{ "ffv1", "coder", "rice" },
+		{ "ffv1", "context", "0" },
+		{ "ffv1", "slices", "16" },
+		{ "ffv1", "slicecrc", "0" },
+		{ "utvideo", "pred", "left" },
+		{ NULL },
+	} },
+};
+
+static const struct encprofile *find_profile(const char *name) {
+	for (size_t i = 0; i < sizeof(profiles) / sizeof(*profiles); ++i) {
+		if (strcmp(profiles[i].name, name) == 0)
+			return &profiles[i];
+	}
+
+	return NULL;
+}
+
+static void log_settings(AVCodecContext *ctx, const AVCodec *codec, AVDictionary *unused) {
+	logln("Encoder %s: gop %i, b-frames %i, threads %i (%s), bitrate %lli",
+			codec->name, ctx->gop_size, ctx->max_b_frames, ctx->thread_count,
+			ctx->thread_type & FF_THREAD_SLICE ? "slice" : "frame",
+			(long long)ctx->bit_rate);
+
+	static const char *const privopts[] = { "preset", "tune", "crf", "rc", NULL };
+	for (const char *const *key = privopts; *key; ++key) {
+		uint8_t *val;
+		if (av_opt_get(ctx, *key, AV_OPT_SEARCH_CHILDREN, &val) >= 0) {
+			logln("  %s: %s", *key, (char *)val);
+			av_free(val);
+		}
+	}
+
+	const AVDictionaryEntry *e = NULL;
+	while ((e = av_dict_get(unused, "", e, AV_DICT_IGNORE_SUFFIX)))
+		logln("  Option '%s' not supported by %s, ignored.", e->key, codec->name);
+}
+
+// Open the codec with the profile's options and the user's overrides
+static int open_codec(AVCodecContext *ctx, const AVCodec *codec, struct encconf *conf) {
+	AVDictionary *opts = NULL;
+
+	if (conf->profile != NULL) {
+		const struct encprofile *profile = find_profile(conf->profile);
+		int64_t gop = (int64_t)profile->gop_seconds * conf->fps;
+		av_dict_set_int(&opts, "g", gop > 0 ? gop : 1, 0);
+		for (const struct encopt *opt = profile->opts; opt->key; ++opt) {
+			if (fnmatch(opt->codecs, codec->name, 0) == 0)
+				av_dict_set(&opts, opt->key, opt->value, 0);
+		}
+	}
+
+	// Frames we mark as I, like the first after resuming, should be IDR frames,
+	// which a player can start from
+	if (fnmatch("libx264", codec->name, 0) == 0 || fnmatch("*nvenc*", codec->name, 0) == 0)
+		av_dict_set(&opts, "forced-idr", "1", 0);
+
+	av_dict_copy(&opts, conf->opts, 0);
+
+	int ret = avcodec_open2(ctx, codec, &opts);
+	if (ret >= 0 && !conf->quiet)
+		log_settings(ctx, codec, opts);
+
+	av_dict_free(&opts);
+	return ret;
+}
+
 static void setconf(AVCodecContext *ctx, enum AVPixelFormat fmt, struct encconf *conf) {
 	ctx->time_base = (AVRational) { 1, conf->fps };
+	ctx->framerate = (AVRational) { conf->fps, 1 };
 	ctx->pix_fmt = fmt;
 	ctx->width = conf->width;
 	ctx->height = conf->height;
+	if (conf->global_header)
+		ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	// Pass frames' opaque_ref on to their packets, for latency tracking.
+	// Encoders which delay frames must support reordering it.
+	int caps = ctx->codec->capabilities;
+	if (!(caps & AV_CODEC_CAP_DELAY) || (caps & AV_CODEC_CAP_ENCODER_REORDERED_OPAQUE))
+		ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+}
+
+// The software pixel format: the configured one if any, else the codec's preferred one
+static enum AVPixelFormat sw_format(const AVCodec *codec, struct encconf *conf) {
+	if (conf->pix_fmt == NULL)
+		return codec->pix_fmts[0];
+
+	enum AVPixelFormat fmt = av_get_pix_fmt(conf->pix_fmt);
+	for (const enum AVPixelFormat *f = codec->pix_fmts; f && *f != AV_PIX_FMT_NONE; ++f) {
+		if (*f == fmt)
+			return fmt;
+	}
+
+	logln("Encoder %s doesn't support pixel format %s.", codec->name, conf->pix_fmt);
+	return AV_PIX_FMT_NONE;
 }
 
 static int set_hwframe_ctx(
@@ -76,7 +248,7 @@ static int try_nvenc(
 
 	*ctx = avcodec_alloc_context3(*codec);
 	setconf(*ctx, (*codec)->pix_fmts[0], conf);
-	return avcodec_open2(*ctx, *codec, NULL);
+	return open_codec(*ctx, *codec, conf);
 }
 
 static int try_vaapi(
@@ -91,8 +263,8 @@ static int try_vaapi(
 	*ctx = avcodec_alloc_context3(*codec);
 	setconf(*ctx, AV_PIX_FMT_VAAPI, conf);
 
-	// Create hardware device
-	static AVBufferRef *hw_device_ctx = NULL;
+	// Create hardware device. The frames context keeps its own reference.
+	AVBufferRef *hw_device_ctx = NULL;
 	int ret = av_hwdevice_ctx_create(
 			&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI,
 			NULL, NULL, 0);
@@ -103,13 +275,14 @@ static int try_vaapi(
 	}
 
 	ret = set_hwframe_ctx(*ctx, hw_device_ctx, AV_PIX_FMT_NV12, conf);
+	av_buffer_unref(&hw_device_ctx);
 	if (ret < 0) {
 		logln("Failed to set hwframe context.");
 		avcodec_free_context(ctx);
 		return ret;
 	}
 
-	ret = avcodec_open2(*ctx, *codec, NULL);
+	ret = open_codec(*ctx, *codec, conf);
 	if (ret < 0) {
 		avcodec_free_context(ctx);
 		return -1;
@@ -118,10 +291,66 @@ static int try_vaapi(
 	return ret;
 }
 
+// When no hardware encoder works, use the default software encoder
+static int try_software(
+		const AVCodec **codec, AVCodecContext **ctx,
+		struct encconf *conf) {
+
+	*codec = avcodec_find_encoder(conf->id);
+	if (*codec == NULL) {
+		logln("Found no %s encoder.", avcodec_get_name(conf->id));
+		return -1;
+	}
+
+	enum AVPixelFormat fmt = sw_format(*codec, conf);
+	if (fmt == AV_PIX_FMT_NONE)
+		return -1;
+
+	*ctx = avcodec_alloc_context3(*codec);
+	setconf(*ctx, fmt, conf);
+
+	return open_codec(*ctx, *codec, conf);
+}
+
+// In order of preference
+static const struct {
+	const char *name;
+	int (*try)(const AVCodec **codec, AVCodecContext **ctx, struct encconf *conf);
+} probes[] = {
+	{ "nvenc", try_nvenc },
+	{ "vaapi", try_vaapi },
+	{ "software", try_software },
+};
+
+// Everything in the config which may make a hardware encoder refuse it
+static uint64_t probe_hash(struct encconf *conf) {
+	char buf[64];
+	uint64_t h = PROBECACHE_HASH_INIT;
+	snprintf(buf, sizeof(buf), "%ix%i@%i", conf->width, conf->height, conf->fps);
+	h = probecache_hash(h, buf);
+	h = probecache_hash(h, conf->profile ? conf->profile : "");
+	h = probecache_hash(h, conf->pix_fmt ? conf->pix_fmt : "");
+
+	char *opts = NULL;
+	if (conf->opts && av_dict_get_string(conf->opts, &opts, '=', ',') >= 0 && opts) {
+		h = probecache_hash(h, opts);
+		av_free(opts);
+	} else {
+		h = probecache_hash(h, "");
+	}
+
+	return h;
+}
+
 int open_encoder(
 		const AVCodec **codec, AVCodecContext **ctx,
 		const char *name, struct encconf *conf) {
 
+	if (conf->profile != NULL && find_profile(conf->profile) == NULL) {
+		logln("Unknown encoder profile: %s", conf->profile);
+		return -1;
+	}
+
 	if (name != NULL) {
 		*codec = avcodec_find_encoder_by_name(name);
 		if (*codec == NULL) {
@@ -129,9 +358,13 @@ int open_encoder(
 			return -1;
 		}
 
+		enum AVPixelFormat fmt = sw_format(*codec, conf);
+		if (fmt == AV_PIX_FMT_NONE)
+			return -1;
+
 		*ctx = avcodec_alloc_context3(*codec);
-		setconf(*ctx, (*codec)->pix_fmts[0], conf);
-		int ret = avcodec_open2(*ctx, *codec, NULL);
+		setconf(*ctx, fmt, conf);
+		int ret = open_codec(*ctx, *codec, conf);
 
 		if (ret < 0)
 			avcodec_free_context(ctx);
@@ -139,21 +372,40 @@ int open_encoder(
 		return ret;
 	}
 
-	// Try out nvenc
-	fprintf(stderr, "Trying out nvenc...\n");
-	if (try_nvenc(codec, ctx, conf) >= 0)
-		return 0;
+	// Start with whichever worked last time, so that we don't wait
+	// for probes which are known to fail on this machine. Whether hardware
+	// takes the config depends on the config, so that's part of the key.
+	char key[64];
+	snprintf(key, sizeof(key), "encoder.%s.%016llx",
+			avcodec_get_name(conf->id), (unsigned long long)probe_hash(conf));
+	char *cached = probecache_get(key);
+	int first = -1;
+	for (size_t i = 0; cached && i < sizeof(probes) / sizeof(*probes); ++i) {
+		if (strcmp(probes[i].name, cached) == 0)
+			first = i;
+	}
+	free(cached);
 
-	// Try out vaapi
-	fprintf(stderr, "Trying out vaapi...\n");
-	if (try_vaapi(codec, ctx, conf) >= 0)
-		return 0;
+	if (first >= 0) {
+		fprintf(stderr, "Trying out %s, which worked last time...\n", probes[first].name);
+		*ctx = NULL;
+		if (probes[first].try(codec, ctx, conf) >= 0)
+			return 0;
+		avcodec_free_context(ctx);
+	}
 
-	// Give up, just find a sw encoder
-	fprintf(stderr, "Found no hardware encoder, just using the default software encoder.\n");
-	*codec = avcodec_find_encoder(conf->id);
-	*ctx = avcodec_alloc_context3(*codec);
-	setconf(*ctx, (*codec)->pix_fmts[0], conf);
+	for (int i = 0; i < (int)(sizeof(probes) / sizeof(*probes)); ++i) {
+		if (i == first)
+			continue;
+
+		fprintf(stderr, "Trying out %s...\n", probes[i].name);
+		*ctx = NULL;
+		if (probes[i].try(codec, ctx, conf) >= 0) {
+			probecache_put(key, probes[i].name);
+			return 0;
+		}
+		avcodec_free_context(ctx);
+	}
 
-	return avcodec_open2(*ctx, *codec, NULL);
+	return -1;
 }
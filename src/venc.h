@@ -1,6 +1,7 @@
 #ifndef VENC_H
 #define VENC_H
 
+#include <stdbool.h>
 #include <libavcodec/avcodec.h>
 
 struct encconf {
@@ -8,6 +9,21 @@ struct encconf {
 	int fps;
 	int width;
 	int height;
+	bool global_header;
+
+	// Software pixel format name, or NULL for the codec's preferred one
+	const char *pix_fmt;
+
+	// Tuning profile ("realtime", "lowlatency", "balanced", "archival"
+	// or "lossless"),
+	// or NULL for codec defaults
+	const char *profile;
+
+	// Codec options which override the profile's
+	AVDictionary *opts;
+
+	// Don't log the effective settings
+	bool quiet;
 };
 
 int open_encoder(
@@ -0,0 +1,162 @@
+#include "writer.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+#include "time.h"
+#include "timeline.h"
+
+static void report(struct writer *w) {
+	pthread_mutex_lock(&w->mut);
+	logln("%s: queue %i (max %i) packets, %zu KiB; write avg %.3fms, max %.3fms",
+			w->tlname, w->queued, w->max_queued, w->queued_bytes / 1024,
+			w->writes ? w->write_time / w->writes * 1000.0 : 0.0,
+			w->max_write_time * 1000.0);
+	w->max_queued = w->queued;
+	w->writes = 0;
+	w->write_time = 0;
+	w->max_write_time = 0;
+	pthread_mutex_unlock(&w->mut);
+}
+
+static void *writer_thread(void *arg) {
+	struct writer *w = (struct writer *)arg;
+
+	double nextsec = time_now() + 1;
+	while (1) {
+		pthread_mutex_lock(&w->mut);
+		while (w->head == NULL && !w->closed)
+			pthread_cond_wait(&w->cond_data, &w->mut);
+
+		struct writer_pkt *wp = w->head;
+		if (wp == NULL) {
+			pthread_mutex_unlock(&w->mut);
+			break;
+		}
+
+		w->head = wp->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+		pthread_mutex_unlock(&w->mut);
+
+		int size = wp->pkt->size;
+
+		// The muxer consumes the packet, so keep a copy of its timestamps
+		struct frameinfo *fi = frameinfo_get(wp->pkt->opaque_ref);
+		struct frameinfo info;
+		bool has_info = fi != NULL;
+		if (has_info)
+			info = *fi;
+
+		timeline_begin(w->tlname);
+		if (mux_write(w->mux, wp->pkt) < 0)
+			panic("Failed to write packet.");
+		timeline_end(w->tlname);
+
+		// Most packets only go into the outfile's buffer; the time spent
+		// writing blocks to storage is what's worth reporting
+		struct outfile_stats ws = { 0 };
+		if (w->mux->outfile)
+			outfile_take_stats(w->mux->outfile, &ws);
+
+		atomic_fetch_add_explicit(&w->total_packets, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&w->total_bytes, size, memory_order_relaxed);
+		if (has_info && w->latency)
+			latency_record(w->latency, &info, time_now_ns());
+
+		av_packet_free(&wp->pkt);
+		free(wp);
+
+		pthread_mutex_lock(&w->mut);
+		w->queued -= 1;
+		w->queued_bytes -= size;
+		w->writes += ws.writes;
+		w->write_time += ws.time;
+		if (ws.max_time > w->max_write_time)
+			w->max_write_time = ws.max_time;
+		pthread_cond_signal(&w->cond_space);
+		pthread_mutex_unlock(&w->mut);
+
+		if (time_now() >= nextsec) {
+			report(w);
+			nextsec += 1;
+		}
+	}
+
+	return NULL;
+}
+
+struct writer *writer_create(struct mux *mux, size_t budget, int idx, struct latency *latency) {
+	struct writer *w = malloc(sizeof(*w));
+	w->mux = mux;
+	w->latency = latency;
+	if (idx == 0)
+		snprintf(w->tlname, sizeof(w->tlname), "write");
+	else
+		snprintf(w->tlname, sizeof(w->tlname), "write%i", idx);
+	pthread_mutex_init(&w->mut, NULL);
+	pthread_cond_init(&w->cond_space, NULL);
+	pthread_cond_init(&w->cond_data, NULL);
+	w->head = NULL;
+	w->tail = NULL;
+	w->closed = false;
+	w->budget = budget;
+	w->queued_bytes = 0;
+	w->queued = 0;
+	w->max_queued = 0;
+	w->writes = 0;
+	w->write_time = 0;
+	w->max_write_time = 0;
+	atomic_init(&w->total_packets, 0);
+	atomic_init(&w->total_bytes, 0);
+
+	pthread_create(&w->thread, NULL, writer_thread, w);
+	return w;
+}
+
+void writer_push(struct writer *w, AVPacket *pkt) {
+	struct writer_pkt *wp = malloc(sizeof(*wp));
+	wp->next = NULL;
+	wp->pkt = av_packet_alloc();
+	if (wp->pkt == NULL)
+		panic("Failed to allocate AVPacket.");
+	av_packet_move_ref(wp->pkt, pkt);
+
+	pthread_mutex_lock(&w->mut);
+
+	// An empty queue always accepts a packet, no matter how large
+	while (w->queued > 0 && w->queued_bytes + wp->pkt->size > w->budget)
+		pthread_cond_wait(&w->cond_space, &w->mut);
+
+	if (w->tail)
+		w->tail->next = wp;
+	else
+		w->head = wp;
+	w->tail = wp;
+
+	w->queued += 1;
+	w->queued_bytes += wp->pkt->size;
+	if (w->queued > w->max_queued)
+		w->max_queued = w->queued;
+
+	pthread_cond_signal(&w->cond_data);
+	pthread_mutex_unlock(&w->mut);
+}
+
+int writer_queued(struct writer *w) {
+	return __atomic_load_n(&w->queued, __ATOMIC_RELAXED);
+}
+
+void writer_free(struct writer *w) {
+	pthread_mutex_lock(&w->mut);
+	w->closed = true;
+	pthread_cond_signal(&w->cond_data);
+	pthread_mutex_unlock(&w->mut);
+
+	pthread_join(w->thread, NULL);
+
+	pthread_mutex_destroy(&w->mut);
+	pthread_cond_destroy(&w->cond_space);
+	pthread_cond_destroy(&w->cond_data);
+	free(w);
+}
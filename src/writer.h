@@ -0,0 +1,65 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+#include "mux.h"
+#include "latency.h"
+
+/*
+ * The writer muxes and writes packets on its own thread,
+ * so that slow storage doesn't stall the encoder.
+ */
+
+struct writer_pkt {
+	struct writer_pkt *next;
+	AVPacket *pkt;
+};
+
+struct writer {
+	struct mux *mux;
+	struct latency *latency;
+	char tlname[16];
+	pthread_t thread;
+
+	pthread_mutex_t mut;
+	pthread_cond_t cond_space;
+	pthread_cond_t cond_data;
+	struct writer_pkt *head;
+	struct writer_pkt *tail;
+	bool closed;
+
+	// Memory budget for queued packets
+	size_t budget;
+	size_t queued_bytes;
+	int queued;
+
+	// Stats since the last report. Writes are the outfile's writes to storage.
+	int max_queued;
+	int writes;
+	double write_time;
+	double max_write_time;
+
+	// Totals, readable without the lock
+	_Atomic uint64_t total_packets;
+	_Atomic uint64_t total_bytes;
+};
+
+// 'idx' is the output's index, used to name the writer in logs and the timeline.
+// Written packets' latencies are recorded in 'latency' unless it's NULL.
+struct writer *writer_create(struct mux *mux, size_t budget, int idx, struct latency *latency);
+
+// Queue a packet for writing, taking ownership of its reference.
+// Only blocks if the queue's memory budget is exhausted.
+void writer_push(struct writer *w, AVPacket *pkt);
+
+// Number of queued packets, without taking the lock.
+int writer_queued(struct writer *w);
+
+// Write all queued packets and stop the writer thread.
+void writer_free(struct writer *w);
+
+#endif
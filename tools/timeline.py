@@ -1,124 +1,85 @@
-import svgwrite
-import re
-
-infile = "timeline.log"
-outfile = "timeline.svg"
-
-hpos = 100
-hsec = 600
-vsize = 30
-vsep = 15
-
-class Timeline:
-    def __init__(self, name):
-        self.name = name
-        self.rangestart = None
-        self.ranges = []
-
-    def begin(self, time):
-        self.rangestart = time
-
-    def end(self, time):
-        if self.rangestart == None:
-            print("Warning: "+self.name+" got end without a begin")
-            return
-        self.ranges.append((self.rangestart, time))
-        self.rangestart = None
-
-    def draw(self, svg, idx, starttime, endtime):
-        sy = idx * (vsize + vsep)
-        ey = sy + vsize
-
-        col = svgwrite.rgb(60, 84, 242, 'rgb')
-
-        svg.add(svg.text(
-            text=self.name,
-            insert=(10, sy + vsize / 1.5 + vsep / 2),
-            fill=col))
-
-        for r in self.ranges:
-            sx = (r[0] - starttime) * hsec + hpos
-            ex = (r[1] - starttime) * hsec + hpos
-
-            svg.add(svg.rect(
-                insert=(sx, sy + vsep / 2),
-                size=(ex - sx, ey - sy),
-                fill=col))
-
-        if self.rangestart is not None:
-            sx = (self.rangestart - starttime) * hsec + hpos
-            ex = (endtime - starttime) * hsec + hpos
-
-            svg.add(svg.rect(
-                insert=(sx, sy + vsep / 2),
-                size=(ex - sx, ey - sy),
-                fill=col))
-
+# Convert a timeline file written by xrecord --timeline into
+# Chrome trace-event JSON, which can be opened in https://ui.perfetto.dev
+# or chrome://tracing.
+#
+# Usage: python3 timeline.py [timeline.bin] [timeline.json]
+
+import json
+import struct
+import sys
+
+infile = sys.argv[1] if len(sys.argv) > 1 else "timeline.bin"
+outfile = sys.argv[2] if len(sys.argv) > 2 else "timeline.json"
+
+MAGIC = b"XRTL\0\0\0\1"
+RECORD = struct.Struct("<QqIHBx")
+
+NAME = 0
+BEGIN = 1
+END = 2
+DROPPED = 3
+
+names = {}
+threads = {}
+events = []
 starttime = None
-endtime = None
-timelines = []
-timelinesMap = {}
+dropped = 0
+
+with open(infile, "rb") as f:
+    data = f.read()
+
+if not data.startswith(MAGIC):
+    sys.exit(infile + ": Not a timeline file")
 
-rx = re.compile(r"(.*)?:\s*(.*)?:\s*(.*)")
-for line in open(infile):
-    if not line.endswith("\n"):
+pos = len(MAGIC)
+while pos + RECORD.size <= len(data):
+    time, frame, name, thread, kind = RECORD.unpack_from(data, pos)
+    pos += RECORD.size
+
+    if kind == NAME:
+        names[name] = data[pos:pos + frame].decode("utf-8", "replace")
+        pos += frame
+        continue
+    elif kind == DROPPED:
+        print("Warning: thread " + str(thread) + " dropped " + str(frame) + " events")
+        dropped += frame
         continue
 
-    match = rx.match(line)
-    name = match.group(1)
-    kind = match.group(2)
-    time = float(match.group(3))
-
-    if kind == "REGISTER":
-        timelinesMap[name] = Timeline(name)
-        timelines.append(timelinesMap[name])
-    elif kind == "BEGIN":
-        if timelinesMap[name] is None:
-            print("Warning: "+name+" got BEGIN without REGISTER")
-            continue
-        timelinesMap[name].begin(time)
-
-        if starttime == None or time < starttime:
-            starttime = time
-        if endtime == None or time > endtime:
-            endtime = time
-    elif kind == "END":
-        if timelinesMap[name] is None:
-            print("Warning: "+name+" got END without REGISTER")
-            continue
-        timelinesMap[name].end(time)
-
-svg = svgwrite.Drawing(
-    filename=outfile,
-    viewBox=("0 0 {} {}".format(
-        hpos + hsec * (endtime - starttime),
-        len(timelines) * (vsize + vsep) + vsep)))
-
-# Draw time lines
-idx = 0
-for timeline in timelines:
-    timeline.draw(svg, idx, starttime, endtime)
-
-    # Separator line
-    if idx != 0:
-        svg.add(svg.line(
-            start=(0, idx * (vsize + vsep)),
-            end=(hpos + (endtime - starttime) * hsec, idx * (vsize + vsep)),
-            stroke=svgwrite.rgb(0, 0, 0, 'rgb')))
-
-    idx += 1
-
-# Draw ticks at 1/30 sec boundaries
-pos = starttime
-while pos < endtime:
-    sx = (pos - starttime) * hsec + hpos
-    h = idx * (vsize + vsep)
-    svg.add(svg.line(
-        start=(sx, 0),
-        end=(sx, h),
-        stroke=svgwrite.rgb(100, 100, 100, 'rgb')))
-
-    pos += 1 / 30
-
-svg.save()
-print("Saved "+outfile+", timeline over "+str((endtime - starttime))+"s")
+    if starttime is None or time < starttime:
+        starttime = time
+
+    # Threads are labelled by the first stage seen on them
+    if thread not in threads:
+        threads[thread] = names.get(name, str(name))
+
+    ev = {
+        "name": names.get(name, str(name)),
+        "ph": "B" if kind == BEGIN else "E",
+        "ts": time,
+        "pid": 1,
+        "tid": thread,
+    }
+    if frame >= 0:
+        ev["args"] = {"frame": frame}
+    events.append(ev)
+
+# Trace timestamps are microseconds; keep them relative to the first event
+for ev in events:
+    ev["ts"] = (ev["ts"] - starttime) / 1000.0
+
+events.sort(key=lambda ev: ev["ts"])
+
+for tid, name in threads.items():
+    events.append({
+        "name": "thread_name",
+        "ph": "M",
+        "pid": 1,
+        "tid": tid,
+        "args": {"name": name},
+    })
+
+with open(outfile, "w") as f:
+    json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+
+print("Saved " + outfile + ", " + str(len(events)) + " events" +
+        (", " + str(dropped) + " dropped" if dropped else ""))